@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// load generator for aesdsocket: each thread drives its own connections over loopback
+// and times every request, results are printed as one JSON object
+
+// what the server sends back (must match its -r, always "batch" without keep-alive)
+enum reply_policy {REPLY_RECORD, REPLY_BATCH, REPLY_NONE};
+
+// per-thread results
+struct client {
+	pthread_t tid;
+	int id;
+	unsigned long records, conns, errors;
+	unsigned long tx_bytes, rx_bytes;
+	uint64_t* lat; // request latencies (ns)
+	size_t nlat, lat_cap;
+};
+
+// -----constants-----
+#define RECV_BUF (64 << 10)
+#define RECV_TIMEOUT 5 // seconds before a reply counts as lost
+#define BINARY_CMD "AESDSOCKET_BINARY\n" // switches a connection to length-prefixed frames
+#define FRAME_HDR 4
+
+// -----options-----
+const char* host = "127.0.0.1";
+int port = 9000;
+int nclients = 8;
+size_t rec_sz = 64;
+unsigned long recs_per_conn = 100;
+bool keepalive = false;
+enum reply_policy reply_policy = REPLY_BATCH;
+double duration = 5;
+const char* label = "aesdsocket";
+const char* local_path = NULL; // connect to the server's unix socket instead
+bool framed = false; // send records as binary frames
+size_t stored_sz; // a record as the server stores it (a frame gets a marker, its header and a newline)
+
+atomic_bool stop = false;
+struct sockaddr_in serv_addr;
+struct sockaddr_un local_addr = {.sun_family = AF_UNIX};
+
+static uint64_t now_ns (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+__attribute__((noreturn))
+static void die (const char* what) {
+	perror(what);
+	exit(1);
+}
+
+static void lat_add (struct client* cl, uint64_t ns) {
+	if (cl->nlat == cl->lat_cap) {
+		cl->lat_cap = (cl->lat_cap) ? cl->lat_cap*2 : 4096;
+		cl->lat = realloc(cl->lat, cl->lat_cap*sizeof(uint64_t));
+		if (!cl->lat) die("realloc");
+	}
+	cl->lat[cl->nlat++] = ns;
+}
+
+static int bench_connect (struct client* cl) {
+	int sock = socket((local_path) ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) die("socket");
+	struct timeval tv = {.tv_sec = RECV_TIMEOUT};
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	int one = 1;
+	if (!local_path) setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	int s = (local_path) ? connect(sock, (struct sockaddr*) &local_addr, sizeof(local_addr))
+		: connect(sock, (struct sockaddr*) &serv_addr, sizeof(serv_addr));
+	if (s == -1) {
+		++cl->errors;
+		close(sock);
+		return -1;
+	}
+	++cl->conns;
+	return sock;
+}
+
+static bool send_all (struct client* cl, int sock, const char* buf, size_t sz) {
+	while (sz) {
+		ssize_t n = send(sock, buf, sz, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		buf += n;
+		sz -= n;
+		cl->tx_bytes += n;
+	}
+	return true;
+}
+
+// read until the reply ends with rec as stored (or until EOF if rec is NULL)
+static bool recv_reply (struct client* cl, int sock, char* buf, const char* rec) {
+	size_t seen = 0; // valid bytes in tail
+	char* tail = buf + RECV_BUF; // last stored_sz bytes received
+	while (1) {
+		ssize_t n = recv(sock, buf, RECV_BUF, 0);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		if (n == 0) return !rec;
+		cl->rx_bytes += n;
+		if (!rec) continue;
+
+		// keep the last stored_sz bytes and compare them with our record
+		if ((size_t) n >= stored_sz) {
+			memcpy(tail, buf + n - stored_sz, stored_sz);
+			seen = stored_sz;
+		} else {
+			size_t keep = (seen + n > stored_sz) ? stored_sz - n : seen;
+			memmove(tail, tail + seen - keep, keep);
+			memcpy(tail + keep, buf, n);
+			seen = keep + n;
+		}
+		if (seen == stored_sz && memcmp(tail, rec, stored_sz) == 0) return true;
+	}
+}
+
+// fill in a record unique to this client and sequence number
+static void make_record (char* rec, int id, unsigned long seq) {
+	memset(rec, 'x', rec_sz - 1);
+	char tag[48];
+	int n = snprintf(tag, sizeof(tag), "%d-%lu-", id, seq);
+	memcpy(rec, tag, ((size_t) n < rec_sz - 1) ? (size_t) n : rec_sz - 1);
+	rec[rec_sz - 1] = '\n';
+}
+
+static void* client_run (void* param_v) {
+	struct client* cl = (struct client*) param_v;
+	char* buf = malloc(RECV_BUF + stored_sz);
+	// a request is [binary command on a new connection, frame header] record, and it's
+	// stored as [marker, frame header] record [newline]
+	size_t cmd_sz = (framed) ? strlen(BINARY_CMD) : 0, hdr_sz = (framed) ? FRAME_HDR : 0;
+	char* req = malloc(cmd_sz + hdr_sz + rec_sz);
+	char* stored = malloc(stored_sz);
+	if (!buf || !req || !stored) die("malloc");
+	memcpy(req, BINARY_CMD, cmd_sz);
+	uint32_t len = htonl(rec_sz);
+	memcpy(req + cmd_sz, &len, hdr_sz);
+	char* rec = req + cmd_sz + hdr_sz;
+	if (framed) {
+		stored[0] = '\0';
+		memcpy(stored + 1, &len, FRAME_HDR);
+		stored[stored_sz - 1] = '\n';
+	}
+	size_t req_sz = cmd_sz + hdr_sz + rec_sz;
+	unsigned long seq = 0;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		uint64_t t0 = now_ns();
+		int sock = bench_connect(cl);
+		if (sock == -1) continue;
+
+		if (!keepalive) { // one record, the server replies (or not) and closes
+			make_record(rec, cl->id, seq++);
+			if (send_all(cl, sock, req, req_sz) && recv_reply(cl, sock, buf, NULL)) {
+				lat_add(cl, now_ns() - t0);
+				++cl->records;
+			} else ++cl->errors;
+			close(sock);
+			continue;
+		}
+
+		// keep-alive: a request is a record and its reply, or the whole connection without replies
+		bool ok = true;
+		unsigned long i = 0;
+		for (; ok && i < recs_per_conn && !atomic_load_explicit(&stop, memory_order_relaxed); ++i) {
+			make_record(rec, cl->id, seq++);
+			memcpy(stored + ((framed) ? 1 + FRAME_HDR : 0), rec, rec_sz);
+			uint64_t t = now_ns();
+			ok = (i) ? send_all(cl, sock, req + cmd_sz, req_sz - cmd_sz) : send_all(cl, sock, req, req_sz);
+			if (ok && reply_policy != REPLY_NONE) {
+				ok = recv_reply(cl, sock, buf, stored);
+				if (ok) lat_add(cl, now_ns() - t);
+			}
+			if (ok) ++cl->records;
+		}
+		shutdown(sock, SHUT_WR);
+		if (ok) ok = recv_reply(cl, sock, buf, NULL); // server closes once it has everything
+		if (ok && reply_policy == REPLY_NONE) lat_add(cl, now_ns() - t0);
+		if (!ok) ++cl->errors;
+		close(sock);
+	}
+	free(buf);
+	free(req);
+	free(stored);
+	return NULL;
+}
+
+static int cmp_u64 (const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static double pct_us (uint64_t* lat, size_t n, double p) {
+	if (!n) return 0;
+	size_t i = (size_t) (p*n);
+	if (i >= n) i = n - 1;
+	return lat[i]/1e3;
+}
+
+int main (int argc, char** argv) {
+	// parse args: -H host, -p port, -c clients (threads), -s record size, -n records per connection,
+	// -k (keep-alive, else connect per record), -r record|batch|none (server's reply policy),
+	// -t seconds, -l label (server name for the results), -u path (connect to the server's unix socket),
+	// -f (send records as binary frames)
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:c:s:n:kr:t:l:u:f")) != -1) {
+		switch (opt) {
+			case 'H': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': nclients = atoi(optarg); break;
+			case 's': rec_sz = strtoul(optarg, NULL, 0); break;
+			case 'n': recs_per_conn = strtoul(optarg, NULL, 0); break;
+			case 'k': keepalive = true; break;
+			case 'r':
+				if (strcmp(optarg, "record") == 0) reply_policy = REPLY_RECORD;
+				else if (strcmp(optarg, "batch") == 0) reply_policy = REPLY_BATCH;
+				else if (strcmp(optarg, "none") == 0) reply_policy = REPLY_NONE;
+				else opt = '?';
+				break;
+			case 't': duration = atof(optarg); break;
+			case 'l': label = optarg; break;
+			case 'u': local_path = optarg; break;
+			case 'f': framed = true; break;
+		}
+		if (opt == '?' || nclients <= 0 || rec_sz < 2 || recs_per_conn == 0 || duration <= 0) {
+			fprintf(stderr, "usage: %s [-H host] [-p port] [-c clients] [-s record size] [-n records/conn]"
+				" [-k] [-r record|batch|none] [-t seconds] [-l label] [-u path] [-f]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (local_path && strlen(local_path) >= sizeof(local_addr.sun_path)) {
+		fprintf(stderr, "path too long: %s\n", local_path);
+		return 2;
+	}
+	if (local_path) strcpy(local_addr.sun_path, local_path);
+	stored_sz = (framed) ? 1 + FRAME_HDR + rec_sz + 1 : rec_sz;
+	serv_addr = (struct sockaddr_in) {.sin_family = AF_INET, .sin_port = htons(port)};
+	if (inet_pton(AF_INET, host, &serv_addr.sin_addr) != 1) {
+		fprintf(stderr, "bad address %s\n", host);
+		return 2;
+	}
+
+	// run clients for the duration
+	struct client* clients = calloc(nclients, sizeof(struct client));
+	if (!clients) die("calloc");
+	uint64_t start = now_ns();
+	for (int i = 0; i < nclients; ++i) {
+		clients[i].id = i;
+		int s = pthread_create(&clients[i].tid, NULL, client_run, &clients[i]);
+		if (s != 0) {
+			errno = s;
+			die("pthread_create");
+		}
+	}
+	struct timespec ts = {.tv_sec = (time_t) duration, .tv_nsec = (long) ((duration - (time_t) duration)*1e9)};
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+	atomic_store(&stop, true);
+	for (int i = 0; i < nclients; ++i)
+		pthread_join(clients[i].tid, NULL);
+	double elapsed = (now_ns() - start)/1e9;
+
+	// merge results
+	struct client tot = {0};
+	for (int i = 0; i < nclients; ++i) {
+		struct client* cl = &clients[i];
+		tot.records += cl->records;
+		tot.conns += cl->conns;
+		tot.errors += cl->errors;
+		tot.tx_bytes += cl->tx_bytes;
+		tot.rx_bytes += cl->rx_bytes;
+		for (size_t j = 0; j < cl->nlat; ++j) lat_add(&tot, cl->lat[j]);
+		free(cl->lat);
+	}
+	free(clients);
+	qsort(tot.lat, tot.nlat, sizeof(uint64_t), cmp_u64);
+
+	static const char* policies[] = {"record", "batch", "none"};
+	printf("{\"server\":\"%s\",\"transport\":\"%s\",\"framing\":\"%s\",\"mode\":\"%s\",\"reply\":\"%s\",\"clients\":%d,\"record_size\":%zu,"
+		"\"records_per_conn\":%lu,\"seconds\":%.3f,\"records\":%lu,\"conns\":%lu,\"errors\":%lu,"
+		"\"records_per_s\":%.1f,\"tx_mb_per_s\":%.3f,\"rx_mb_per_s\":%.3f,"
+		"\"samples\":%zu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+		label, (local_path) ? "unix" : "tcp", (framed) ? "binary" : "newline", (keepalive) ? "keepalive" : "connect", policies[reply_policy], nclients, rec_sz,
+		(keepalive) ? recs_per_conn : 1, elapsed, tot.records, tot.conns, tot.errors,
+		tot.records/elapsed, tot.tx_bytes/elapsed/1e6, tot.rx_bytes/elapsed/1e6,
+		tot.nlat, pct_us(tot.lat, tot.nlat, 0.5), pct_us(tot.lat, tot.nlat, 0.99), pct_us(tot.lat, tot.nlat, 0.999));
+	free(tot.lat);
+	return 0;
+}
@@ -1,5 +1,9 @@
 #define _GNU_SOURCE
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -7,56 +11,619 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <signal.h>
 #include <syslog.h>
 #include <sys/mman.h>
+#include <linux/falloc.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <pthread.h>
-	
-// client thread parameters
+#include <semaphore.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <poll.h>
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#define LOG_MSG_MAX 120
+#define LOG_RING_SLOTS 256 // per thread (power of 2)
+#define HIST_SUB_BITS 3 // histogram buckets per power of 2 (log2)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define CHRDEV_ENTRIES 10 // records the driver keeps (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+#define SEG_SLOTS 1024 // most output segments kept (the oldest is retired to make room)
+#define IDX_GROW 65536 // records the index file grows by at a time
+#define IDX_HDR 4096 // index file header (the tail marker), records follow it
+#define IDX_MAGIC "AESDIDX1"
+
+// connection states
+// CS_SYNC: reply waits for its records to be durable, CS_FOLLOW: follower waits for more output
+enum conn_state {CS_RECV, CS_SYNC, CS_SEND, CS_FOLLOW, CS_DONE};
+
+// per-connection state (shared by the thread and epoll servers)
+struct conn {
+	int sock;
+	struct in_addr addr;
+	bool local; // came in on the unix socket
+	bool binary; // sends length-prefixed frames instead of newline-terminated records
+	char cip[24]; // client address string, or the local peer's pid (for logging)
+	enum conn_state state;
+	bool nonblock; // socket is driven by epoll
+	bool parked; // waiting in an epoll worker's (or the ring's) sync queue
+	uint32_t events; // epoll events currently registered
+	size_t packet_sz; // bytes received into packet
+	size_t rec_start; // start of the current (partial) record
+	size_t scan_off; // first byte not yet scanned for a delimiter
+	size_t nrecords; // records stored so far
+	size_t ncmds; // commands answered so far
+	size_t stored_sz; // output length just after this connection's last record
+	size_t reply_off; // reply cursor
+	size_t reply_sz; // total reply length
+	unsigned inflight; // io_uring operations in flight
+	uint64_t req_start; // when the oldest unanswered data arrived (ns, 0: nothing pending)
+	uint64_t watch_at; // when it last made progress (ns, while it's watched)
+	bool follow; // keeps being sent the output as it's committed
+	struct conn** list; // epoll worker's (or the ring's) list it waits on: replies, requests or followers
+	struct conn *wprev, *wnext;
+#ifndef USE_AESD_CHAR_DEVICE
+	struct segment* seg; // segment the reply is being sent from (holds a reference)
+#else
+	struct mrec* snap[CHRDEV_ENTRIES]; // records in the reply snapshot, oldest first (mirror references)
+	unsigned nsnap;
+	size_t reply_lo, reply_len; // plain output file range currently in the reply buffer
+#endif
+
+	// buffers from here on are kept across connections
+	char* packet; // packet buffer
+	size_t max_packet; // packet buffer capacity
+	char* reply; // reply streaming buffer (chrdev on a plain file only)
+	size_t reply_cap; // reply buffer capacity
+	struct conn* next; // next idle connection in an epoll worker's cache
+};
+
+// listening socket and the thread accepting on it
+struct acceptor {
+	pthread_t tid;
+	int sock;
+	int cpu; // core the acceptor is pinned to (-1: not pinned)
+};
+
+// accepted connection (waiting for a pool worker)
 struct client {
 	int sock;
 	struct in_addr addr;
+	bool local; // from the unix socket (no address)
 };
 
-// thread list entry
-struct node {
+// worker thread (pool or epoll)
+struct worker {
 	pthread_t tid;
-	struct node* next;
-	struct client c;
+	int epfd; // epoll set (-1 for pool workers)
+	struct conn* _Atomic free_conns; // idle connections (popped by the acceptor, pushed by the worker)
+	_Atomic size_t nfree;
+	int wakefd; // eventfd poked after each flush (group commit), for followers, and on a handoff (epoll only)
+	_Atomic bool follow_armed; // has followers waiting: the next commit pokes wakefd
+	struct conn* parked; // connections waiting for a flush (worker only)
+	struct conn* following; // followers waiting for more output (worker only)
+	struct conn* sending; // connections whose reply is waiting on the client (worker only)
+	struct conn* receiving; // connections waiting for a request (worker only, with an idle timeout)
+	struct conn* closed; // closed while handling a batch of events, cached once it's done (worker only)
+	uint64_t swept; // when those were last checked for stalls
+};
+
+#ifndef USE_AESD_CHAR_DEVICE
+// output segment: a file holding a contiguous range of the output (all of it without -s)
+struct segment {
+	unsigned long seq;
+	int fd;
+	char* mem; // file mapping (only moves when an unsegmented output outgrows its reservation)
+	size_t vsz; // address space reserved for the mapping
+	_Atomic size_t memsz; // allocated file size
+	size_t cap; // most it may hold
+	size_t base; // output offset of its first byte
+	_Atomic size_t tail; // end of space reserved by appenders (SEG_SEALED once it's full)
+	_Atomic size_t end; // output offset just past its last byte (SIZE_MAX while it's active)
+	time_t sealed; // when it was filled
+	_Atomic unsigned refs; // readers using it, plus one while it's in the segment table
+};
+
+// record index file header: a restart finds the committed output through it
+struct idx_hdr {
+	char magic[8];
+	uint64_t base; // output offset its first record starts at
+	_Atomic uint64_t n; // records in the file (the output is committed up to the end of the last one)
+};
+#endif
+
+#ifdef USE_AESD_CHAR_DEVICE
+// record the device holds, mirrored in memory (never changes, shared by the mirror and reply snapshots)
+struct mrec {
+	_Atomic unsigned refs;
+	size_t sz;
+	char data[];
+};
+#endif
+
+#ifdef USE_IO_URING
+// io_uring submission/completion queues
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	unsigned sqe_tail; // local tail (published on submit)
+	struct io_uring_buf_ring* br; // provided receive buffers
+	char* bufs;
+	unsigned short br_tail;
+};
+#endif
+
+// log message types (each is rate limited separately)
+enum log_type {LM_ACCEPT, LM_CLOSE, LM_PACKET, LM_SENT, LM_WARN, LM_NTYPES};
+
+// log record queued for the logger thread
+struct logrec {
+	int prio;
+	char msg[LOG_MSG_MAX];
 };
 
+// per-thread log ring (single producer: its thread, single consumer: the logger)
+struct logring {
+	struct logrec recs[LOG_RING_SLOTS];
+	_Atomic unsigned head, tail;
+	time_t window; // current rate limit window (second)
+	unsigned nwindow[LM_NTYPES]; // messages of each type logged in the window
+	_Atomic unsigned long suppressed[LM_NTYPES]; // rate limited messages (collected by the logger)
+	_Atomic unsigned long dropped; // messages lost to a full ring
+	struct logring* next;
+};
+
+// metrics counters and histograms
+enum stat_ctr {ST_CONNS, ST_RECORDS, ST_BYTES_IN, ST_BYTES_OUT, ST_BYTES_COPIED, ST_MREMAPS, ST_FLUSHES,
+	ST_ROLLS, ST_RETIRED, ST_SLOW, ST_LOCAL_CONNS, ST_LOCAL_RECORDS, ST_SHED, ST_RATE_LIMITED, ST_OVERSIZE,
+	ST_IDLE, ST_RELOADS, ST_NCTRS};
+enum stat_hist {SH_PACKET, SH_LATENCY, SH_LOCAL_LATENCY, SH_LOCK_WAIT, SH_LOCK_HOLD, SH_NHISTS};
+
+// log-linear histogram (HIST_SUB_BITS of precision per power of 2)
+struct hist {
+	_Atomic unsigned long sum;
+	_Atomic unsigned long b[HIST_BUCKETS];
+};
+
+// per-thread metrics (written only by their thread, summed by the stats endpoint)
+struct metrics {
+	_Atomic unsigned long ctr[ST_NCTRS];
+	struct hist hist[SH_NHISTS];
+	struct metrics* next;
+};
+
+// server concurrency models
+enum server_mode {MODE_THREAD, MODE_EPOLL, MODE_URING};
+
+// when data written through the mapping is pushed to disk
+enum durability {DUR_NONE, DUR_ASYNC, DUR_GROUP};
+
+// when to echo the output file back to the client
+enum reply_policy {REPLY_RECORD, REPLY_BATCH, REPLY_NONE};
+
+// a command a record asks for (CMD_NONE: it's stored like any other)
+enum command {CMD_NONE, CMD_IS_BINARY, CMD_IS_TAIL, CMD_IS_FROM, CMD_IS_RANGE, CMD_IS_FOLLOW};
+
 // -----constants-----
 #define INITIAL_MAX_PACKET 1024
-#define MAX_BACKLOG 8
+#define FRAME_RESERVE_MAX (64 << 10) // most room made for a binary frame ahead of its bytes arriving
+#define DEFAULT_MAX_FRAME (64UL << 20) // largest binary frame taken without a -P limit
+#define FRAME_HDR 4 // binary framing: big-endian payload length before each record
+#define FRAME_MARK '\0' // stored framed records are FRAME_MARK, the header, the payload and a newline
+#define DEFAULT_BACKLOG 8
+#define MAX_EVENTS 64
+#define POOL_THREADS_PER_CPU 4 // default pool size (pool workers block on their clients)
+#define WORKQ_PER_THREAD 2 // work queue slots per pool worker
+#define DEFAULT_BUF_TRIM (64 << 10) // connection buffers bigger than this are freed on close
+#define CONN_CACHE_MAX 256 // idle connections cached per epoll worker
+#define DEFAULT_WRITEBACK_MS 1000 // background writeback period (-D async)
+#define DEFAULT_SEND_TIMEOUT 30 // seconds a reply may stall before its client is dropped
+#define SEND_SWEEP_NS 1000000000 // stalled replies (and idle clients) are looked for this often
+#define RATE_BITS 12 // per-address connection rate slots (log2)
+#define MAX_CONN_RATE 0xffff // connections per second one rate slot can count
+#define DRAIN_GRACE_MS 200 // a handoff lets connections finish this long before hurrying idle ones
+#define DRAIN_SECS 10 // longest a handoff waits for connections to finish
+#define HANDOFF_MAX_FDS 64 // listeners one handoff can carry
+#define DEFAULT_LOG_RATE 1000 // messages of each type per thread per second
+#define LOG_DRAIN_NS 10000000 // logger polls the rings this often
+#define DEFAULT_VSZ ((sizeof(void*) >= 8) ? (64UL << 30) : (256UL << 20)) // address space reserved for the mapping
+#define IDX_VSZ_RATIO 16 // output reservation per byte reserved for the record index (an entry per 128 byte record)
+#define IDX_VSZ_MIN (1UL << 20) // least address space reserved for the record index
+
+// default server model can be picked at build time with -DUSE_EPOLL (or -DUSE_IO_URING)
+#if defined(USE_IO_URING)
+#define DEFAULT_MODE MODE_URING
+#elif defined(USE_EPOLL)
+#define DEFAULT_MODE MODE_EPOLL
+#else
+#define DEFAULT_MODE MODE_THREAD
+#endif
+
+#if defined(USE_IO_URING) && defined(USE_AESD_CHAR_DEVICE)
+#error "the io_uring engine only supports the output file backend"
+#endif
 
 #ifdef USE_AESD_CHAR_DEVICE
 const char* outpath = "/dev/aesdchar";
 #else
 const char* outpath = "/var/tmp/aesdsocketdata";
 #define MAX_TIMELEN 48
-#define WRTIME_PERIOD 10
-static char timestr[MAX_TIMELEN]; // static buffer for time string
+#define DEFAULT_WRTIME_PERIOD 10
+#define SEG_SEALED (SIZE_MAX/2) // segment tail once appenders have to move on
+#define MIN_SEG_SIZE (64 << 10)
+#define SEG_NAME "%s.%08lu" // segment file: output path and sequence number
+#define MANIFEST_NAME "%s.manifest"
+#define INDEX_NAME "%s.index"
+
+// commands: a record that is one of these asks for part of the output instead of being stored
+// (one that merely starts with CMD_PREFIX is stored as usual)
+#define CMD_PREFIX "AESDSOCKET_"
+#define CMD_TAIL CMD_PREFIX "TAIL:" // N: the last N records
+#define CMD_FROM CMD_PREFIX "FROM:" // K: record K (counted from the oldest at startup) onwards
+#define CMD_RANGE CMD_PREFIX "RANGE:" // OFF,LEN: LEN bytes from output offset OFF
+#define CMD_FOLLOW CMD_PREFIX "FOLLOW:" // N: the last N records, then every record as it's committed
+#define CMD_BINARY CMD_PREFIX "BINARY" // switch to binary framing (commands are then sent as frames too)
+// replies aren't framed: they're the output as stored, so a framed record comes back as FRAME_MARK,
+// its FRAME_HDR length, the payload and a newline, and a plain one as a line; to take a reply apart,
+// read a byte: FRAME_MARK starts a framed record (skip the header's length, then the newline),
+// anything else a line
 #endif
 
 // -----globals-----
 long PAGE_SIZE; // \_/()\_/
-int asock = -1; // accepting socket
-int ofd = -1; // output file descriptor
-size_t of_sz = 0;
+struct acceptor* acceptors = NULL; // listening sockets (SO_REUSEPORT shards when there's more than one)
+int nlisteners = 1;
+int nacceptors = 0; // running acceptor threads (none when main accepts on the only listener)
+const char* local_path = NULL; // unix socket for clients on this host (-u)
+int local_sock = -1; // nonblocking, every acceptor takes from it
+_Atomic size_t of_sz = 0; // committed output length (readers never look past this)
 #ifndef USE_AESD_CHAR_DEVICE
-void* of_mem = NULL; // output file mapping
-size_t of_memsz = 0; // size of output file mapping
-char* of_pt = NULL; // output cursor
+struct segment* segs[SEG_SLOTS]; // retained segments, by sequence number
+_Atomic unsigned long seg_first = 0, seg_last = 0; // oldest retained and active segments
+struct segment* of_active = NULL; // segment being appended to
+_Atomic size_t of_first = 0; // output offset of the oldest retained byte
+size_t of_vsz = 0; // address space reserved for an unsegmented output mapping
+pthread_rwlock_t of_maplk = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP; // held exclusively to move the mapping or change segments
+pthread_mutex_t of_growlk = PTHREAD_MUTEX_INITIALIZER; // serialises output file growth and segment changes
+size_t seg_size = 0; // split the output into segments this big (0: a single file)
+size_t keep_bytes = 0; // retire the oldest segments beyond this much output (0: no limit)
+unsigned keep_secs = 0; // retire segments filled longer ago than this (0: no limit)
+const char* archive_dir = NULL; // retired segments are moved here instead of deleted
+int idx_fd = -1; // record index file (kept across restarts)
+struct idx_hdr* idx_hdr = NULL; // its header (mapped)
+uint64_t* idx_ents = NULL; // record index: output offset just past each record, by record number (mapped)
+size_t idx_fsz = 0; // index file size
+size_t idx_moff = 0; // index file offset the record mapping starts at
+char* idx_mem = NULL; // the record mapping (moves when its reservation runs out, under of_maplk held exclusively)
+size_t idx_vsz = 0; // address space reserved for it
+size_t idx_skip = 0; // records in the file before record 0 (retired by an earlier run)
+size_t idx_old_n = 0; // records a previous run left in the file (startup only)
+_Atomic size_t idx_n = 0; // records indexed
+size_t idx_0 = 0; // output offset record 0 starts at
+size_t idx_first = 0; // oldest retained record (under of_maplk)
+size_t idx_lo = 0; // index file offset it's been punched out below (under of_maplk)
+size_t grow_chunk = 0; // grow output file in steps of this size (0: double it)
+bool use_hugepages = false; // ask for transparent huge pages on the mapping
+bool of_pinned = false; // the mapping may not move (io_uring sends straight from it)
+bool use_sendfile = true; // send replies straight from the page cache (else copy from the mapping)
+enum durability durability = DUR_NONE;
+unsigned writeback_ms = DEFAULT_WRITEBACK_MS;
+_Atomic size_t of_durable = 0; // output known to be on disk (group commit)
+size_t of_sync_want = 0; // output a flush has been asked to cover (under sync_lk)
+pthread_mutex_t sync_lk = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sync_req = PTHREAD_COND_INITIALIZER; // wakes the syncer
+pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER; // wakes blocking waiters after a flush
+pthread_t sync_tid;
+bool sync_running = false;
+unsigned wrtime_period = DEFAULT_WRTIME_PERIOD; // seconds between timestamps (0: none)
+int wrtime_fd = -1; // timestamp timerfd
+pthread_t wrtime_tid;
+bool wrtime_running = false;
 #else
-#define MAX_ALLOCA_BUF ((PTHREAD_STACK_MIN >> 2)*3) 
+int ofd = -1; // output file descriptor
+#define MAX_ALLOCA_BUF ((PTHREAD_STACK_MIN >> 2)*3)
+#define REPLY_CHUNK (64 << 10) // replies stream through a buffer this big
+#define PROBE_MAX 256 // device tail bytes checked against the mirror before each reply
+struct mrec* of_mirror[CHRDEV_ENTRIES]; // the records the device holds, by write number (under of_lk)
+unsigned long of_nwrites = 0; // records written to the device (under of_lk)
+size_t of_devsz = 0; // bytes held by the device (under of_lk)
+bool of_evicts = true; // the device drops its oldest record past CHRDEV_ENTRIES (not a plain file)
+bool of_mirrored = true; // the mirror follows the device (until it's written around the server in a way it can't)
+#endif
+pthread_mutex_t of_lk = PTHREAD_MUTEX_INITIALIZER; // output file lock (chrdev)
+pthread_mutex_t of_openlk = PTHREAD_MUTEX_INITIALIZER; // serialises opening the output file on first accept
+struct worker* workers = NULL; // worker threads
+int nworkers = 0;
+struct worker* follow_worker = NULL; // pool engine: epoll worker its followers are handed to
+struct client* workq = NULL; // ring of connections waiting for a pool worker
+size_t workq_cap = 0;
+size_t workq_head = 0, workq_tail = 0;
+pthread_mutex_t workq_lk = PTHREAD_MUTEX_INITIALIZER; // only held to move the ring indices
+sem_t workq_items, workq_free; // queued connections, free slots
+size_t buf_trim = DEFAULT_BUF_TRIM;
+_Atomic unsigned long nallocs = 0, nfrees = 0, ntrims = 0; // buffer allocation counters (flat in steady state)
+#ifdef USE_IO_URING
+struct uring ring = {.fd = -1};
+struct conn* uring_idle = NULL; // idle io_uring connections
+struct conn* uring_parked = NULL; // connections waiting for a flush
+struct conn* uring_sending = NULL; // connections with a send in flight
+struct conn* uring_receiving = NULL; // connections waiting for a request (with an idle timeout)
+size_t uring_sync_end = 0; // output the flush in flight covers
+struct segment* uring_sync_seg = NULL; // segment it flushes
+bool uring_syncing = false;
+struct conn* uring_following = NULL; // followers waiting for more output
+int uring_wakefd = -1; // poked for followers, and on a handoff
+_Atomic bool uring_armed = false; // has followers waiting: the next commit pokes uring_wakefd
+bool uring_draining = false; // stopped accepting for a handoff
+#endif
+enum server_mode mode = DEFAULT_MODE;
+bool keepalive = false; // keep connections open for more records
+unsigned send_timeout = DEFAULT_SEND_TIMEOUT; // drop a client whose reply makes no progress for this long (0: never)
+size_t conn_sndbuf = 0; // most reply bytes the kernel queues for a connection (SO_SNDBUF, 0: system default)
+unsigned idle_timeout = 0; // drop a client that sends nothing for this long while a request is awaited (0: never)
+int max_conns = 0; // shed connections beyond this many open (0: no limit)
+unsigned conn_rate = 0; // shed connections from one address beyond this many a second (0: no limit)
+size_t max_record = 0; // drop a client whose record grows past this (0: no limit)
+_Atomic uint64_t rate_slots[1 << RATE_BITS]; // address, second (low 16 bits) and connections in it, packed
+enum reply_policy reply_policy = REPLY_BATCH;
+int log_level = LOG_INFO; // connection messages above this priority are discarded
+unsigned log_rate = DEFAULT_LOG_RATE; // 0: unlimited
+struct logring* _Atomic log_rings = NULL; // every thread's ring
+time_t log_noted = 0; // second the logger last reported suppressed and dropped messages in
+_Thread_local struct logring* log_self = NULL;
+pthread_t log_tid;
+bool log_running = false;
+struct metrics stats_spare; // shared by threads that couldn't allocate their own
+struct metrics* _Atomic stats_all = &stats_spare; // every thread's metrics
+_Thread_local struct metrics* stats_self = NULL;
+const char* stats_path = NULL; // unix socket serving metrics (-S)
+int stats_sock = -1;
+pthread_t stats_tid;
+bool stats_running = false;
+const char* handoff_path = NULL; // unix socket a restarted server takes the listeners over on (-U)
+const char* pid_path = NULL; // the server's pid is written here (-p), and rewritten by the one it hands off to
+int handoff_sock = -1; // listening for the next server
+int handoff_peer = -1; // the next server, once it has asked
+int drain_fd = -1; // eventfd telling the acceptors to stop (handoff only)
+_Atomic bool draining = false; // handing off: finish what's open, take nothing new
+_Atomic int accepting = 0; // accept loops still running
+_Atomic int nconns = 0; // accepted connections not closed yet
+_Atomic int nfollowers = 0; // connections following the output
+_Atomic bool* conn_socks = NULL; // open client sockets, by descriptor (only tracked for a handoff)
+int conn_socks_max = 0;
+pthread_t handoff_tid;
+bool handoff_running = false;
+
+
+//-----logging-----
+// connection messages are formatted into the calling thread's ring and written to syslog by the
+// logger thread; startup, shutdown and fatal errors still go straight to syslog
+
+static const char* log_types[LM_NTYPES] = {
+	[LM_ACCEPT] = "accept", [LM_CLOSE] = "close", [LM_PACKET] = "packet",
+	[LM_SENT] = "reply", [LM_WARN] = "warning"
+};
+
+// queue a connection message (never blocks; drops it if rate limited or the ring is full)
+__attribute__((format(printf, 3, 4)))
+static void logmsg (int prio, enum log_type type, const char* fmt, ...) {
+	if (prio > log_level) return;
+	struct logring* lr = log_self;
+	if (!lr) { // first message from this thread
+		lr = calloc(1, sizeof(struct logring));
+		if (!lr) return;
+		lr->next = atomic_load(&log_rings);
+		while (!atomic_compare_exchange_weak(&log_rings, &lr->next, lr));
+		log_self = lr;
+	}
+
+	if (log_rate) {
+		time_t now = time(NULL);
+		if (now != lr->window) {
+			lr->window = now;
+			memset(lr->nwindow, 0, sizeof(lr->nwindow));
+		}
+		if (lr->nwindow[type]++ >= log_rate) {
+			atomic_fetch_add_explicit(&lr->suppressed[type], 1, memory_order_relaxed);
+			return;
+		}
+	}
+
+	unsigned tail = atomic_load_explicit(&lr->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&lr->head, memory_order_acquire) == LOG_RING_SLOTS) {
+		atomic_fetch_add_explicit(&lr->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	struct logrec* rec = &lr->recs[tail % LOG_RING_SLOTS];
+	rec->prio = prio;
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(rec->msg, LOG_MSG_MAX, fmt, ap);
+	va_end(ap);
+	atomic_store_explicit(&lr->tail, tail + 1, memory_order_release);
+}
+
+// write out everything queued so far (logger thread, or teardown once it has stopped); messages lost
+// to the rate limit or full rings are summed over all threads and noted once a second (and at the end)
+static void log_flush (bool final) {
+	time_t now = time(NULL);
+	bool note = final || now != log_noted;
+	unsigned long suppressed[LM_NTYPES] = {0}, dropped = 0;
+	for (struct logring* lr = atomic_load(&log_rings); lr; lr = lr->next) {
+		unsigned head = atomic_load_explicit(&lr->head, memory_order_relaxed);
+		unsigned tail = atomic_load_explicit(&lr->tail, memory_order_acquire);
+		for (; head != tail; ++head) {
+			struct logrec* rec = &lr->recs[head % LOG_RING_SLOTS];
+			syslog(rec->prio, "%s", rec->msg);
+			atomic_store_explicit(&lr->head, head + 1, memory_order_release);
+		}
+		if (!note) continue;
+		for (int t = 0; t < LM_NTYPES; ++t)
+			suppressed[t] += atomic_exchange_explicit(&lr->suppressed[t], 0, memory_order_relaxed);
+		dropped += atomic_exchange_explicit(&lr->dropped, 0, memory_order_relaxed);
+	}
+	if (!note) return;
+	log_noted = now;
+	for (int t = 0; t < LM_NTYPES; ++t)
+		if (suppressed[t]) syslog(LOG_NOTICE, "rate limit suppressed %lu %s messages", suppressed[t], log_types[t]);
+	if (dropped) syslog(LOG_NOTICE, "log ring full, dropped %lu messages", dropped);
+}
+
+static void* logger (void* unused) {
+	while (1) {
+		log_flush(false);
+		struct timespec ts = {.tv_nsec = LOG_DRAIN_NS};
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+
+//-----metrics-----
+// updates are plain relaxed stores to the calling thread's own metrics, so the hot path
+// takes no locks and no locked instructions; the stats endpoint sums every thread's
+
+static const char* stat_names[ST_NCTRS] = {
+	[ST_CONNS] = "connections_total", [ST_RECORDS] = "records_total",
+	[ST_BYTES_IN] = "received_bytes_total", [ST_BYTES_OUT] = "sent_bytes_total",
+	[ST_BYTES_COPIED] = "copied_bytes_total", [ST_MREMAPS] = "mapping_moves_total",
+	[ST_FLUSHES] = "flushes_total", [ST_ROLLS] = "segment_rolls_total",
+	[ST_RETIRED] = "segments_retired_total", [ST_SLOW] = "slow_clients_total",
+	[ST_LOCAL_CONNS] = "local_connections_total", [ST_LOCAL_RECORDS] = "local_records_total",
+	[ST_SHED] = "shed_connections_total", [ST_RATE_LIMITED] = "rate_limited_connections_total",
+	[ST_OVERSIZE] = "oversized_records_total", [ST_IDLE] = "idle_clients_total",
+	[ST_RELOADS] = "device_reloads_total"
+};
+static const char* hist_names[SH_NHISTS] = {
+	[SH_PACKET] = "record_size_bytes", [SH_LATENCY] = "request_latency_ns",
+	[SH_LOCAL_LATENCY] = "local_request_latency_ns",
+	[SH_LOCK_WAIT] = "lock_wait_ns", [SH_LOCK_HOLD] = "lock_hold_ns"
+};
+
+static uint64_t now_ns (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static struct metrics* stats_get (void) {
+	struct metrics* m = stats_self;
+	if (!m) { // first update from this thread
+		m = calloc(1, sizeof(struct metrics));
+		if (!m) return stats_self = &stats_spare;
+		m->next = atomic_load(&stats_all);
+		while (!atomic_compare_exchange_weak(&stats_all, &m->next, m));
+		stats_self = m;
+	}
+	return m;
+}
+
+// add to a single-writer counter
+static void stat_inc (_Atomic unsigned long* v, unsigned long n) {
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void stat_add (enum stat_ctr ctr, unsigned long n) {
+	stat_inc(&stats_get()->ctr[ctr], n);
+}
+
+static unsigned hist_bucket (uint64_t v) {
+	if (v < (1 << HIST_SUB_BITS)) return v;
+	int e = 63 - __builtin_clzl(v);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// largest value that falls in a bucket
+static uint64_t hist_bound (unsigned k) {
+	if (k < (1 << HIST_SUB_BITS)) return k;
+	int shift = (k >> HIST_SUB_BITS) - 1;
+	uint64_t lower = (uint64_t) ((1 << HIST_SUB_BITS) + (k & ((1 << HIST_SUB_BITS) - 1))) << shift;
+	return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+static void stat_hist (enum stat_hist h, uint64_t v) {
+	struct hist* hs = &stats_get()->hist[h];
+	stat_inc(&hs->sum, v);
+	stat_inc(&hs->b[hist_bucket(v)], 1);
+}
+
+// write every thread's metrics, summed, in the Prometheus text format
+static void stats_write (FILE* f) {
+	unsigned long ctr[ST_NCTRS] = {0};
+	static unsigned long b[HIST_BUCKETS]; // only used by the stats thread
+	for (struct metrics* m = atomic_load(&stats_all); m; m = m->next)
+		for (int i = 0; i < ST_NCTRS; ++i) ctr[i] += atomic_load_explicit(&m->ctr[i], memory_order_relaxed);
+	for (int i = 0; i < ST_NCTRS; ++i)
+		fprintf(f, "# TYPE aesdsocket_%s counter\naesdsocket_%s %lu\n", stat_names[i], stat_names[i], ctr[i]);
+	fprintf(f, "# TYPE aesdsocket_output_bytes gauge\naesdsocket_output_bytes %zu\n", (size_t) of_sz);
+#ifndef USE_AESD_CHAR_DEVICE
+	fprintf(f, "# TYPE aesdsocket_retained_bytes gauge\naesdsocket_retained_bytes %zu\n", (size_t) (of_sz - of_first));
+	fprintf(f, "# TYPE aesdsocket_segments gauge\naesdsocket_segments %lu\n", seg_last - seg_first + 1);
+	fprintf(f, "# TYPE aesdsocket_indexed_records gauge\naesdsocket_indexed_records %zu\n", (size_t) idx_n);
+	fprintf(f, "# TYPE aesdsocket_followers gauge\naesdsocket_followers %d\n", (int) nfollowers);
 #endif
-pthread_mutex_t of_lk = PTHREAD_MUTEX_INITIALIZER; // output file lock
-pthread_mutex_t ntoa_lk = PTHREAD_MUTEX_INITIALIZER; // lock for inet_ntoa (uses a static buffer)
-struct node* thread_ll = NULL; // linked list of active threads
+	fprintf(f, "# TYPE aesdsocket_buffer_allocations_total counter\naesdsocket_buffer_allocations_total %lu\n", nallocs);
+	fprintf(f, "# TYPE aesdsocket_buffer_frees_total counter\naesdsocket_buffer_frees_total %lu\n", nfrees);
+
+	for (int h = 0; h < SH_NHISTS; ++h) {
+		unsigned long n = 0, sum = 0;
+		memset(b, 0, sizeof(b));
+		for (struct metrics* m = atomic_load(&stats_all); m; m = m->next) {
+			sum += atomic_load_explicit(&m->hist[h].sum, memory_order_relaxed);
+			for (int k = 0; k < HIST_BUCKETS; ++k)
+				b[k] += atomic_load_explicit(&m->hist[h].b[k], memory_order_relaxed);
+		}
+		fprintf(f, "# TYPE aesdsocket_%s histogram\n", hist_names[h]);
+		for (int k = 0; k < HIST_BUCKETS; ++k) {
+			if (!b[k]) continue; // sparse buckets, cumulative counts
+			n += b[k];
+			fprintf(f, "aesdsocket_%s_bucket{le=\"%lu\"} %lu\n", hist_names[h], (unsigned long) hist_bound(k), n);
+		}
+		fprintf(f, "aesdsocket_%s_bucket{le=\"+Inf\"} %lu\n", hist_names[h], n);
+		fprintf(f, "aesdsocket_%s_sum %lu\naesdsocket_%s_count %lu\n", hist_names[h], sum, hist_names[h], n);
+	}
+}
+
+// serve a metrics snapshot to every client of the stats socket
+static void* stats_serve (void* unused) {
+	while (1) {
+		int csock = accept4(stats_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (csock == -1) continue; // nothing to clean up, a scraper will retry
+
+		char* buf = NULL;
+		size_t len = 0;
+		FILE* f = open_memstream(&buf, &len);
+		if (f) {
+			stats_write(f);
+			fclose(f);
+			for (size_t off = 0; off < len;) {
+				ssize_t n = send(csock, buf + off, len - off, MSG_NOSIGNAL);
+				if (n == -1 && errno == EINTR) continue;
+				if (n <= 0) break;
+				off += n;
+			}
+			free(buf);
+		}
+		close(csock);
+	}
+	return NULL;
+}
 
 
 // ------error handling-----
@@ -65,7 +632,9 @@ typedef enum {SRC_SOCKET, SRC_LISTEN, SRC_INT = SIGINT, // this has to be locate
 	SRC_BIND, SRC_OPEN, SRC_MMAP, SRC_MREMAP, SRC_ACCEPT, SRC_SIGACTION,
 	SRC_MALLOC, SRC_REALLOC, SRC_FSTAT, SRC_CLOSE, SRC_READ, SRC_WRITE,
 	SRC_TERM = SIGTERM, SRC_FTRUNCATE, SRC_EINVAL, SRC_DUP,
-	SRC_PTHCR, SRC_PTHJN, SRC_STRFTIME, SRC_PTHATTR, SRC_C_WRITE, SRC_C_READ} cleanup_src;
+	SRC_PTHCR, SRC_PTHJN, SRC_STRFTIME, SRC_PTHATTR, SRC_C_WRITE, SRC_C_READ,
+	SRC_EPOLL, SRC_URING, SRC_TIMER, SRC_STATS, SRC_SYNC, SRC_MANIFEST, SRC_INDEX,
+	SRC_HANDOFF, SRC_HANDED, SRC_PIDFILE} cleanup_src;
 
 // error message table
 const char* errs[] = {
@@ -93,17 +662,79 @@ const char* errs[] = {
 	[SRC_STRFTIME] = "error formatting time",
 	[SRC_PTHATTR] = "error setting thread attributes",
 	[SRC_C_WRITE] = "error writing to circular buffer",
-	[SRC_C_READ] = "error reading from circular buffer"
+	[SRC_C_READ] = "error reading from circular buffer",
+	[SRC_EPOLL] = "error in epoll",
+	[SRC_URING] = "error in io_uring",
+	[SRC_TIMER] = "error in timestamp timer",
+	[SRC_STATS] = "error setting up stats socket",
+	[SRC_SYNC] = "error flushing output file",
+	[SRC_MANIFEST] = "error writing segment manifest",
+	[SRC_INDEX] = "error in record index file",
+	[SRC_HANDOFF] = "error handing off listeners",
+	[SRC_HANDED] = "Handed off to new server, exiting",
+	[SRC_PIDFILE] = "error writing pid file"
 };
 
+// pass the listeners to the server that asked for them
+static void handoff_give (void) {
+	int fds[HANDOFF_MAX_FDS], n = 0;
+	for (int i = 0; acceptors && i < nlisteners && n < HANDOFF_MAX_FDS; ++i)
+		if (acceptors[i].sock != -1) fds[n++] = acceptors[i].sock;
+	if (local_sock != -1 && n < HANDOFF_MAX_FDS) fds[n++] = local_sock; // told apart by its family
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} ctl;
+	char tag = 'L';
+	struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf, .msg_controllen = CMSG_SPACE(n*sizeof(int))};
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(n*sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, n*sizeof(int));
+	if (sendmsg(handoff_peer, &msg, MSG_NOSIGNAL) == -1)
+		syslog(LOG_ERR, "%s: %s", errs[SRC_HANDOFF], strerror(errno));
+	close(handoff_peer);
+}
+
 // main cleanup handler
 __attribute__((noreturn))
 static void cleanup_errno (cleanup_src src, int e) {
-	// cleanup threads
-	for (struct node* n = thread_ll; n; n = n->next)
-		pthread_cancel(n->tid);
-	for (struct node* n = thread_ll; n; n = n->next)
-		pthread_join(n->tid, NULL);
+	// cleanup threads (acceptors first, they feed the workers)
+	for (int i = 0; i < nacceptors; ++i)
+		pthread_cancel(acceptors[i].tid);
+	for (int i = 0; i < nacceptors; ++i)
+		pthread_join(acceptors[i].tid, NULL);
+#ifndef USE_AESD_CHAR_DEVICE
+	if (wrtime_running) {
+		pthread_cancel(wrtime_tid);
+		pthread_join(wrtime_tid, NULL);
+	}
+#endif
+	for (int i = 0; i < nworkers; ++i)
+		pthread_cancel(workers[i].tid);
+	for (int i = 0; i < nworkers; ++i)
+		pthread_join(workers[i].tid, NULL);
+#ifndef USE_AESD_CHAR_DEVICE
+	if (sync_running) {
+		pthread_cancel(sync_tid);
+		pthread_join(sync_tid, NULL);
+	}
+#endif
+	if (stats_running) {
+		pthread_cancel(stats_tid);
+		pthread_join(stats_tid, NULL);
+	}
+	if (handoff_running) {
+		pthread_cancel(handoff_tid);
+		pthread_join(handoff_tid, NULL);
+	}
+	if (log_running) { // last, so it can't be cancelled while others are still logging
+		pthread_cancel(log_tid);
+		pthread_join(log_tid, NULL);
+	}
+	log_flush(true);
 
 	// record exit cause
 	const char* msg = errs[src];
@@ -114,20 +745,79 @@ static void cleanup_errno (cleanup_src src, int e) {
 		syslog(LOG_ERR, "%s: %s", msg, strerror(e));
 		xstat = -1;
 	}
+	syslog(LOG_INFO, "buffer allocations %lu, frees %lu, trims %lu", nallocs, nfrees, ntrims);
 	closelog();
 
 	// clean up state
-	struct node* p;
-	for (struct node* n = thread_ll; n; n = p) {
-		p = n->next;
-	   	free(n);
-	}	
-	if (asock != -1) close(asock);
+	for (int i = 0; i < nworkers; ++i) {
+		if (workers[i].epfd != -1) close(workers[i].epfd);
+		if (workers[i].wakefd != -1) close(workers[i].wakefd);
+	}
+	free(workers);
+	for (; workq && workq_head != workq_tail; workq_head = (workq_head + 1) % workq_cap)
+		close(workq[workq_head].sock);
+	free(workq);
+#ifdef USE_AESD_CHAR_DEVICE
 	if (ofd != -1) close (ofd);
+#endif
+	if (stats_sock != -1) {
+		close(stats_sock);
+		unlink(stats_path);
+	}
+	if (handoff_sock != -1) {
+		close(handoff_sock);
+		if (src != SRC_HANDED) unlink(handoff_path); // the next server binds its own
+	}
+	if (drain_fd != -1) close(drain_fd);
+	free(conn_socks);
+	if (local_sock != -1 && src != SRC_HANDED) { // closed after a handoff
+		close(local_sock);
+		unlink(local_path);
+	}
+	if (pid_path && src != SRC_HANDED && src != SRC_PIDFILE) unlink(pid_path); // the next server wrote its own
+#ifndef USE_AESD_CHAR_DEVICE
+	if (wrtime_fd != -1) close(wrtime_fd);
+#endif
+#ifdef USE_IO_URING
+	// the ring's pending accept holds the listener until the ring is torn down
+	// asynchronously; shut it so the port is free on exit
+	// (a handed off listener was never part of it)
+	if (src != SRC_HANDED && acceptors && acceptors[0].sock != -1) shutdown(acceptors[0].sock, SHUT_RDWR);
+	if (ring.fd != -1) close(ring.fd);
+	if (uring_wakefd != -1) close(uring_wakefd);
+#endif
 #ifndef USE_AESD_CHAR_DEVICE
-	if (of_mem) munmap(of_mem, of_memsz);
-	unlink(outpath);
+	// the output goes with the server (archived segments are kept), unless the next one takes it over:
+	// then it's left as a restart after a clean exit would find it
+	char path[PATH_MAX];
+	for (unsigned long seq = seg_first; seq <= seg_last; ++seq) {
+		struct segment* sg = segs[seq % SEG_SLOTS];
+		if (!sg) continue;
+		if (sg->mem) munmap(sg->mem, sg->vsz);
+		if (src == SRC_HANDED && sg == of_active) { // give back what was preallocated past the output
+			if (ftruncate(sg->fd, of_sz - sg->base) == -1 || (durability != DUR_NONE && fdatasync(sg->fd) == -1))
+				syslog(LOG_ERR, "error finishing output file for handoff: %s", strerror(errno));
+		}
+		close(sg->fd);
+		snprintf(path, sizeof(path), SEG_NAME, outpath, seq);
+		if (seg_size && src != SRC_HANDED) unlink(path);
+	}
+	snprintf(path, sizeof(path), MANIFEST_NAME, outpath);
+	if (src != SRC_HANDED) {
+		if (!seg_size) unlink(outpath);
+		else if (of_active) unlink(path); // not one a previous run left if we never got going
+	}
+	if (idx_fd != -1) { // the index goes (or stays) with the output
+		snprintf(path, sizeof(path), INDEX_NAME, outpath);
+		if (src != SRC_HANDED && (!seg_size || of_active)) unlink(path);
+		close(idx_fd);
+	}
 #endif
+	if (src == SRC_HANDED) handoff_give(); // last, the next server starts from everything above
+	for (int i = 0; acceptors && i < nlisteners; ++i)
+		if (acceptors[i].sock != -1) close(acceptors[i].sock);
+	free(acceptors);
+	if (local_sock != -1 && src == SRC_HANDED) close(local_sock);
 
 	exit(xstat);
 }
@@ -143,7 +833,7 @@ __attribute__((noreturn))
 static void sigcleanup (int sig, siginfo_t* info, void* unused) {
 	assert(sig == SIGTERM || sig == SIGINT);
 	if (info->si_code == SI_QUEUE) {
-		int32_t* unpack = (int32_t*) &info->si_ptr; 
+		int32_t* unpack = (int32_t*) &info->si_ptr;
 		cleanup_errno((cleanup_src) unpack[0], unpack[1]);
 	} else cleanup_errno((cleanup_src) sig, 0);
 }
@@ -157,307 +847,2676 @@ static void cleanup_thr (cleanup_src src) {
 	pthread_exit(NULL);
 }
 
-//-----client thread-----
+// cleanup function to use for errors in shared code
+typedef void (*cleanup_fn) (cleanup_src);
+
+//-----output file-----
 
-// close socket if cancelled
-static void vclose(void* fdpt) {
-	close(*(int*) fdpt);
+#ifndef USE_AESD_CHAR_DEVICE
+// apply access hints to a segment mapping
+static void of_advise (struct segment* sg) {
+	madvise(sg->mem, sg->vsz, MADV_SEQUENTIAL);
+	if (use_hugepages && madvise(sg->mem, sg->vsz, MADV_HUGEPAGE) == -1)
+		syslog(LOG_WARNING, "huge pages unavailable for output file: %s", strerror(errno));
 }
 
-static void* client_thread (void* param_v) {
-	// these must be declared before pushing the cleanup handler
-	// because it creates a scope...
-	int s;
-	char* cip;
-	struct client* param = (struct client*) param_v;
-	pthread_cleanup_push(vclose, &param->sock);
+// take of_maplk shared (only contended while the mapping moves or segments change)
+static void of_rdlock (void) {
+	if (pthread_rwlock_tryrdlock(&of_maplk) != 0) {
+		uint64_t t = now_ns();
+		pthread_rwlock_rdlock(&of_maplk);
+		stat_hist(SH_LOCK_WAIT, now_ns() - t);
+	}
+}
 
-	// log accepted connection
-	cip = alloca(INET_ADDRSTRLEN);
-	pthread_mutex_lock(&ntoa_lk);
-	const char* ipstr = inet_ntoa(param->addr);
-	strncpy(cip, ipstr, INET_ADDRSTRLEN);
-	pthread_mutex_unlock(&ntoa_lk);
-	syslog(LOG_INFO, "Accepted connection from %s\n", cip);
-	
-	// alloc packet buffer
-	size_t max_packet = INITIAL_MAX_PACKET;
-	char* packet = malloc(max_packet);
-	if (!packet) cleanup_thr(SRC_MALLOC);
-	pthread_cleanup_push(free, packet);
-
-	// get packet
-	char* delim = NULL;
-	size_t packet_sz = 0;
-	size_t max_read = max_packet;
-	while (!delim) {
-		assert(packet_sz <= max_packet);
-		ssize_t read_sz = read(param->sock, &packet[packet_sz], max_read);	
-		if (read_sz == -1)
-			cleanup_thr(SRC_READ);
-		
-		if (read_sz == max_read) { // need to expand buffer
-			max_read = max_packet;
-			max_packet *= 2;
-			packet = realloc(packet, max_packet);
-			if (!packet) cleanup_thr(SRC_REALLOC);
-		}
-
-		delim = memchr(&packet[packet_sz], '\n', read_sz);
-		packet_sz += read_sz;
-		max_read -= read_sz;
+// output offset just past record k (under of_maplk, k < idx_n)
+static size_t idx_end (size_t k) {
+	return idx_ents[k];
+}
+
+// output offset record k starts at (under of_maplk, k <= idx_n)
+static size_t idx_start (size_t k) {
+	return (k) ? idx_end(k - 1) : idx_0;
+}
+
+// grow the index file to at least need bytes, moving its mapping once the reservation runs out
+static void idx_grow (size_t need, cleanup_fn die) {
+	size_t sz = idx_fsz + IDX_GROW*sizeof(uint64_t);
+	if (sz < need) sz = need;
+	if (sz - idx_moff > idx_vsz) {
+		size_t new_vsz = (sz - idx_moff > 2*idx_vsz) ? sz - idx_moff : 2*idx_vsz;
+		new_vsz = ((new_vsz - 1)/PAGE_SIZE + 1)*PAGE_SIZE;
+		pthread_rwlock_wrlock(&of_maplk);
+		char* mem = mremap(idx_mem, idx_vsz, new_vsz, MREMAP_MAYMOVE);
+		if (mem == MAP_FAILED) die(SRC_INDEX);
+		idx_ents = (uint64_t*) (mem + ((char*) idx_ents - idx_mem));
+		idx_mem = mem;
+		idx_vsz = new_vsz;
+		pthread_rwlock_unlock(&of_maplk);
 	}
+	int s = fallocate(idx_fd, 0, idx_fsz, sz - idx_fsz);
+	if (s == -1 && (errno == EOPNOTSUPP || errno == ENOSYS))
+		s = ftruncate(idx_fd, sz);
+	if (s == -1) die(SRC_INDEX);
+	idx_fsz = sz;
+}
 
-#ifdef USE_AESD_CHAR_DEVICE
-	// write packet to buffer
-	pthread_mutex_lock(&of_lk);
-	size_t wrsz = packet_sz;
-	char* wrpt = packet;
-	ssize_t wrc;
-	do {
-		wrc = write(ofd, wrpt, wrsz);
-		wrsz -= wrc;
-		wrpt += wrc;
-	} while (wrsz > 0 && wrc != -1);
-	if (wrc == -1) cleanup_thr(SRC_C_WRITE);
-	of_sz += packet_sz;
-	syslog(LOG_INFO, "Got packet of length %zu from client, new file length %zu", packet_sz, of_sz);
-	
-	// get buffer contents in userspace
-	char* of_buf = malloc(of_sz);
-	pthread_cleanup_push(free, of_buf);
-	ssize_t rdc;
-	size_t rdsz = of_sz;
-	char* rdpt = of_buf;
-	off_t rd_off = 0;
-	do {
-		rdc = pread(ofd, rdpt, rdsz, rd_off);
-		rdsz -= rdc;
-		rdpt += rdc;
-		rd_off += rdc;
-	} while (rdc > 0 && rdsz > 0);
-	if (rdc == -1) cleanup_thr(SRC_C_READ);
-	if (rdsz > 0) // early EOF
-		syslog(LOG_WARNING, "Read fewer bytes from buffer than expected: %zu of %zu", of_sz - rdsz, of_sz);
-		
-	// send buffer contents to client
-	off64_t sploff = 0;
-	wrsz = of_sz;
-	wrpt = of_buf;
-	do {
-		wrc = write(param->sock, wrpt, wrsz);
-		wrsz -= wrc;
-		wrpt += wrc;
-	} while (wrsz > 0 && wrc != -1);
-	if (wrc == -1) cleanup_thr(SRC_WRITE);
-	pthread_mutex_unlock(&of_lk);
-	syslog(LOG_INFO, "Sent full file back to client, length %zu", of_sz);
-	pthread_cleanup_pop(1); // frees of_buf
-#else 
-	// write packet
-	pthread_mutex_lock(&of_lk);
-	if (of_sz + packet_sz > of_memsz) { // need to expand mapping
-		void* prev_mem = of_mem;
-		size_t new_memsz = ((of_sz + packet_sz)/PAGE_SIZE + 1)*PAGE_SIZE;
-		s = ftruncate(ofd, new_memsz);
-		if (s == -1) cleanup_thr(SRC_FTRUNCATE);
-		of_mem = mremap(of_mem, of_memsz, new_memsz, MREMAP_MAYMOVE);
-		if (of_mem == MAP_FAILED) cleanup_thr(SRC_MREMAP);
-		if (of_mem != prev_mem) of_pt = (char*) of_mem + of_sz;
-		of_memsz = new_memsz;
-	}
-	memcpy(of_pt, packet, packet_sz);
-	of_sz += packet_sz;
-	of_pt += packet_sz;
-	size_t write_sz = of_sz;
-	char* src_pt = (char*) of_mem;
-	pthread_mutex_unlock(&of_lk);
+// index a record ending at end (committers only, one at a time); the file's record count
+// moves after it, so it never points past what's been written
+static void idx_add (size_t end, cleanup_fn die) {
+	size_t k = atomic_load_explicit(&idx_n, memory_order_relaxed);
+	size_t need = IDX_HDR + (idx_skip + k + 1)*sizeof(uint64_t);
+	if (need > idx_fsz) idx_grow(need, die);
+	idx_ents[k] = end;
+	atomic_store_explicit(&idx_n, k + 1, memory_order_release);
+	atomic_store_explicit(&idx_hdr->n, idx_skip + k + 1, memory_order_release);
+}
 
-	// send output file to client, up to its own packet
-	ssize_t wsz = 0;
-	do {
-		write_sz -= wsz;
-		src_pt += wsz;
-		wsz = write(param->sock, of_mem, write_sz);
-	} while (wsz != -1 && write_sz > wsz);
-	if (wsz == -1) cleanup_thr(SRC_WRITE);
-#endif
+// forget records that start before of_first (under of_maplk held exclusively)
+static void idx_retire (void) {
+	size_t lo = idx_first, hi = atomic_load_explicit(&idx_n, memory_order_acquire);
+	while (lo < hi) { // first record starting at or after of_first
+		size_t mid = lo + (hi - lo)/2;
+		if (idx_start(mid) < of_first) lo = mid + 1;
+		else hi = mid;
+	}
+	idx_first = lo;
+	if (!idx_first) return;
+	size_t keep = (IDX_HDR + (idx_skip + idx_first - 1)*sizeof(uint64_t))/PAGE_SIZE*PAGE_SIZE; // idx_start(idx_first) still needs the one before
+	if (keep > idx_lo && fallocate(idx_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, idx_lo, keep - idx_lo) == 0)
+		idx_lo = keep;
+}
 
-	// close & cleanup connection
-	pthread_cleanup_pop(1); // frees packet buffer
-	pthread_cleanup_pop(0);
-	s = close(param->sock);
-	if (s == -1) cleanup(SRC_CLOSE);
-	syslog(LOG_INFO, "Closed connection from %s", cip);
-	return NULL;
+// take a reference to segment seq (NULL if it has been retired)
+static struct segment* seg_get (unsigned long seq) {
+	of_rdlock();
+	struct segment* sg = segs[seq % SEG_SLOTS];
+	if (sg && sg->seq == seq) atomic_fetch_add(&sg->refs, 1);
+	else sg = NULL;
+	pthread_rwlock_unlock(&of_maplk);
+	return sg;
 }
 
-#ifndef USE_AESD_CHAR_DEVICE
-// periodic time logger (SIGALRM handler)
-static void wrtime (int sig) {
-	assert(sig == SIGALRM);
-	time_t t = time(NULL);
-	size_t s = strftime((char*) &timestr, MAX_TIMELEN, "timestamp:%a, %d %b %Y %T %z\n", localtime(&t));
-	if (s == 0) cleanup(SRC_STRFTIME);
-	pthread_mutex_lock(&of_lk);
-	if (of_sz + s > of_memsz) { // need to expand mapping
-		void* prev_mem = of_mem;
-		size_t new_memsz = (of_memsz/PAGE_SIZE + 1)*PAGE_SIZE;
-		s = ftruncate(ofd, new_memsz);
-		if (s == -1) cleanup(SRC_FTRUNCATE);
-		of_mem = mremap(of_mem, of_memsz, new_memsz, MREMAP_MAYMOVE);
-		if (of_mem == MAP_FAILED) cleanup(SRC_MREMAP);
-		if (of_mem != prev_mem) of_pt = (char*) of_mem + of_sz;
-		of_memsz = new_memsz;
-	}
-	memcpy(of_pt, timestr, s);
-	of_sz += s;
-	of_pt += s;
-	pthread_mutex_unlock(&of_lk);
-	alarm(WRTIME_PERIOD);
+// take a reference to the oldest (&seg_first) or the active (&seg_last) segment
+static struct segment* seg_get_end (_Atomic unsigned long* which) {
+	struct segment* sg;
+	while (!(sg = seg_get(atomic_load(which)))); // moved on under us, look again
+	return sg;
 }
-#endif // USE_AESD_CHAR_DEVICE
 
-int main (int argc, char** argv) {
-	// open syslog
-	openlog(NULL, LOG_PERROR, LOG_USER);
+// drop a segment reference, unmapping and closing it after the last one
+static void seg_put (struct segment* sg) {
+	if (atomic_fetch_sub(&sg->refs, 1) != 1) return;
+	if (sg->mem) munmap(sg->mem, sg->vsz);
+	close(sg->fd);
+	free(sg);
+}
 
-	// check for daemon arg
-	bool daemon = false;
-	if (argc == 2 && strncmp("-d", argv[1], 3) == 0) daemon = true;
-	else if (argc >= 2) {
-		errno = EINVAL;   
-		cleanup(SRC_EINVAL);
+// create segment seq at output offset base, with room for at least cap bytes
+static struct segment* seg_open (unsigned long seq, size_t base, size_t cap, cleanup_fn die) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), SEG_NAME, outpath, seq);
+	struct segment* sg = calloc(1, sizeof(struct segment));
+	if (!sg) die(SRC_MALLOC);
+	sg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (sg->fd == -1) die(SRC_OPEN);
+
+	// allocate it all up front, a segment never grows or moves
+	cap = ((cap - 1)/PAGE_SIZE + 1)*PAGE_SIZE;
+	int s = fallocate(sg->fd, 0, 0, cap);
+	if (s == -1 && (errno == EOPNOTSUPP || errno == ENOSYS))
+		s = ftruncate(sg->fd, cap);
+	if (s == -1) die(SRC_FTRUNCATE);
+	sg->mem = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, sg->fd, 0);
+	if (sg->mem == MAP_FAILED) die(SRC_MMAP);
+	of_advise(sg);
+	sg->seq = seq;
+	sg->vsz = sg->memsz = sg->cap = cap;
+	sg->base = base;
+	sg->end = SIZE_MAX;
+	sg->refs = 1;
+	return sg;
+}
+
+// rewrite the list of retained segments (under of_growlk); it's replaced with a rename,
+// so a crash leaves either the old list or the new one
+static void of_manifest (cleanup_fn die) {
+	char path[PATH_MAX], tmp[PATH_MAX];
+	snprintf(path, sizeof(path), MANIFEST_NAME, outpath);
+	snprintf(tmp, sizeof(tmp), MANIFEST_NAME ".tmp", outpath);
+	FILE* f = fopen(tmp, "we");
+	if (!f) die(SRC_MANIFEST);
+	for (unsigned long seq = seg_first; seq <= seg_last; ++seq) {
+		struct segment* sg = segs[seq % SEG_SLOTS];
+		if (sg == of_active) fprintf(f, "%lu %zu - -\n", seq, sg->base); // its size is only known once it's sealed
+		else fprintf(f, "%lu %zu %zu %ld\n", seq, sg->base, sg->end - sg->base, (long) sg->sealed);
 	}
-	
-	// install signal handler
-	sigset_t fullmask;
-	sigfillset(&fullmask); // no alarms during termination
-	struct sigaction act = {
-		.sa_sigaction = sigcleanup,
-		.sa_flags = SA_SIGINFO,
-		.sa_mask = fullmask
-	};
-	int s = sigaction(SIGINT, &act, NULL);
-	if (s == -1) cleanup(SRC_SIGACTION);
-	s = sigaction(SIGTERM, &act, NULL);
-	if (s == -1) cleanup(SRC_SIGACTION);
+	if (fclose(f) == EOF || rename(tmp, path) == -1) die(SRC_MANIFEST);
+}
 
-#ifndef USE_AESD_CHAR_DEVICE
-	// open+mmap output file
-	PAGE_SIZE = sysconf(_SC_PAGESIZE);
-	ofd = open(outpath, O_RDWR | O_CREAT | O_APPEND, 0644);
-	struct stat stat;
-	s = fstat(ofd, &stat);
-	if (s == -1) cleanup(SRC_FSTAT);
-	of_sz = (size_t) stat.st_size;
-	of_memsz = (of_sz/PAGE_SIZE + 1)*PAGE_SIZE;
-	s = ftruncate(ofd, of_memsz);
-	if (s == -1) cleanup(SRC_FTRUNCATE);
-	of_mem = mmap(NULL, of_memsz, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
-	if (of_mem == MAP_FAILED) cleanup(SRC_MMAP);
-	of_pt = (char*) of_mem + of_sz;
-#endif
-
-	// create socket
-	asock = socket(AF_INET, SOCK_STREAM, 0);
-	if (asock == -1) cleanup(SRC_SOCKET);
-	int opt = 1;
-	s = setsockopt(asock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)); // skip waiting for address to be freed
-	if (s == -1) cleanup(SRC_SOCKET);
-
-	// bind socket
-	struct sockaddr_in serv_addr = {
-		.sin_family = AF_INET,
-		.sin_port = htons(9000),
-		.sin_addr = htonl(INADDR_ANY)
-	};
-	s = bind(asock, &serv_addr, sizeof(struct sockaddr_in));
-	if (s == -1) cleanup(SRC_BIND);
+// retire the oldest segment (under of_growlk): its file is deleted (or archived) right away,
+// readers still sending from it keep it open until they're done
+static void seg_retire (cleanup_fn die) {
+	unsigned long seq = seg_first;
+	pthread_rwlock_wrlock(&of_maplk);
+	struct segment* sg = segs[seq % SEG_SLOTS];
+	segs[seq % SEG_SLOTS] = NULL;
+	atomic_store(&seg_first, seq + 1);
+	atomic_store(&of_first, segs[(seq + 1) % SEG_SLOTS]->base);
+	idx_retire();
+	pthread_rwlock_unlock(&of_maplk);
+	of_manifest(die); // first, so it never lists a missing file
 
-	// daemonise if requested
-	if (daemon) {
-		pid_t cpid = fork();
-		if (cpid == 0) { // in daemon
-			int nullfd = open("/dev/null", O_RDWR);
-			if (nullfd == -1) cleanup(SRC_DUP);
-			int fd = dup2(nullfd, fileno(stdout));
-			if (fd == -1) cleanup(SRC_DUP);
-			fd = dup2(nullfd, fileno(stderr));
-			if (fd == -1) cleanup(SRC_DUP);
-			fd = dup2(nullfd, fileno(stdin));
-			if (fd == -1) cleanup(SRC_DUP);
-			
-			syslog(LOG_INFO, "daemonised with pid %d", getpid()); 
-		} else {
-			printf("Daemon pid %d\n", cpid);
-		   	exit(0);
+	char path[PATH_MAX], dest[PATH_MAX];
+	snprintf(path, sizeof(path), SEG_NAME, outpath, seq);
+	if (archive_dir) {
+		snprintf(dest, sizeof(dest), "%s/" SEG_NAME, archive_dir, basename(outpath), seq);
+		if (rename(path, dest) == -1) {
+			logmsg(LOG_WARNING, LM_WARN, "Couldn't archive segment %lu, deleting it: %s", seq, strerror(errno));
+			unlink(path);
 		}
-	}	
+	} else unlink(path);
+	stat_add(ST_RETIRED, 1);
+	seg_put(sg);
+}
 
-	// listen on socket
-	s = listen(asock, MAX_BACKLOG);
-	if (s == -1) cleanup(SRC_LISTEN);
+// retire segments past the size and age limits, and make room in the table for segment next
+// (under of_growlk); the active segment is never retired, nor one with appenders still copying in
+static void seg_trim (unsigned long next, cleanup_fn die) {
+	time_t now = time(NULL);
+	while (seg_first < seg_last) {
+		struct segment* sg = segs[seg_first % SEG_SLOTS];
+		bool room = next - seg_first >= SEG_SLOTS;
+		bool big = keep_bytes && atomic_load(&of_sz) - atomic_load(&of_first) > keep_bytes;
+		bool old = keep_secs && now - sg->sealed > keep_secs;
+		if (!room && !big && !old) break;
+		if (atomic_load(&of_sz) < sg->end) {
+			if (!room) break; // next time
+			while (atomic_load(&of_sz) < sg->end) {
+				pthread_testcancel();
+				sched_yield();
+			}
+		}
+		seg_retire(die);
+	}
+}
 
-#ifndef USE_AESD_CHAR_DEVICE
-	// install alarm handler and start alarm (must be after fork)
-	act.sa_sigaction = NULL; // in case it's a union
-	act.sa_handler = wrtime;
-	act.sa_flags = 0;
-	s = sigaction(SIGALRM, &act, NULL);
-	if (s == -1) cleanup(SRC_SIGACTION);
-	alarm(WRTIME_PERIOD);
+// seal the active segment once a record of sz bytes doesn't fit, and start the next one
+// (a record bigger than a segment gets one of its own, sized to fit)
+static void of_roll (struct segment* full, size_t sz, cleanup_fn die) {
+	pthread_mutex_lock(&of_growlk);
+	if (of_active == full) { // someone else may have got here first
+		size_t used = atomic_exchange(&full->tail, SEG_SEALED);
+		size_t end = full->base + used;
+		if (ftruncate(full->fd, used) == -1) die(SRC_FTRUNCATE); // give back the preallocated rest
+		if (durability != DUR_NONE) { // syncers only look at the active segment, so flush it on the way out
+			while (atomic_load(&of_sz) < end) {
+				pthread_testcancel();
+				sched_yield();
+			}
+			int s = (durability == DUR_GROUP) ? fdatasync(full->fd) : sync_file_range(full->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+			if (s == -1) die(SRC_SYNC);
+		}
+
+		seg_trim(full->seq + 1, die);
+		struct segment* sg = seg_open(full->seq + 1, end, (sz > seg_size) ? sz : seg_size, die);
+		pthread_rwlock_wrlock(&of_maplk);
+		atomic_store(&full->end, end);
+		full->sealed = time(NULL);
+		segs[sg->seq % SEG_SLOTS] = sg;
+		of_active = sg;
+		atomic_store(&seg_last, sg->seq);
+		pthread_rwlock_unlock(&of_maplk);
+		of_manifest(die);
+		seg_trim(sg->seq, die); // the sealed one may be over the limits now
+		stat_add(ST_ROLLS, 1);
+	}
+	pthread_mutex_unlock(&of_growlk);
+}
+
+// apply the age limit between rolls
+static void of_retain (cleanup_fn die) {
+	pthread_mutex_lock(&of_growlk);
+	seg_trim(seg_last, die);
+	pthread_mutex_unlock(&of_growlk);
+}
+
+// grow an unsegmented output file to at least need bytes
+// the mapping is reserved well ahead of the file, so this normally just allocates more file;
+// it only moves once the reservation runs out
+static void of_grow (struct segment* sg, size_t need, cleanup_fn die) {
+	pthread_mutex_lock(&of_growlk);
+	size_t memsz = sg->memsz;
+	if (need > memsz) { // someone else may have got here first
+		size_t new_memsz = (grow_chunk) ? need + grow_chunk : (need > 2*memsz) ? need : 2*memsz;
+		new_memsz = (new_memsz/PAGE_SIZE + 1)*PAGE_SIZE;
+
+		if (new_memsz > sg->vsz && of_pinned) { // can't move, make do with what's reserved
+			if (need > sg->vsz) {
+				syslog(LOG_ERR, "output file outgrew its reserved range, restart with a larger -V");
+				errno = ENOSPC;
+				die(SRC_MREMAP);
+			}
+			new_memsz = sg->vsz;
+		} else if (new_memsz > sg->vsz) { // out of address space, move the mapping
+			size_t new_vsz = (new_memsz > 2*sg->vsz) ? new_memsz : 2*sg->vsz;
+			pthread_rwlock_wrlock(&of_maplk);
+			void* new_mem = mremap(sg->mem, sg->vsz, new_vsz, MREMAP_MAYMOVE);
+			if (new_mem == MAP_FAILED) die(SRC_MREMAP);
+			sg->mem = new_mem;
+			sg->vsz = new_vsz;
+			of_advise(sg);
+			pthread_rwlock_unlock(&of_maplk);
+			stat_add(ST_MREMAPS, 1);
+		}
+
+		// allocate blocks up front so page faults on the new range don't have to
+		int s = fallocate(sg->fd, 0, memsz, new_memsz - memsz);
+		if (s == -1 && (errno == EOPNOTSUPP || errno == ENOSYS))
+			s = ftruncate(sg->fd, new_memsz);
+		if (s == -1) die(SRC_FTRUNCATE);
+		atomic_store(&sg->memsz, new_memsz);
+	}
+	pthread_mutex_unlock(&of_growlk);
+}
+
+// an eventfd write only fails when it's already due to wake its reader
+static void poke (int fd) {
+	uint64_t one = 1;
+	ssize_t n = write(fd, &one, sizeof(one));
+	(void) n;
+}
+
+// output has been committed (or a handoff began: all): wake whoever has followers waiting for it;
+// each waiter arms its poke before it sleeps, so appenders only pay for the first commit after that
+static void follow_wake (bool all) {
+	for (int i = 0; i < nworkers; ++i)
+		if (workers[i].wakefd != -1 && (atomic_exchange(&workers[i].follow_armed, false) || all))
+			poke(workers[i].wakefd);
+#ifdef USE_IO_URING
+	if (uring_wakefd != -1 && (atomic_exchange(&uring_armed, false) || all)) poke(uring_wakefd);
 #endif
+}
 
-	// this thread handles all signals
-	/* only in glibc >= 2.32 though :(
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setsigmask_np(&attr, &fullmask);
-	s = pthread_setattr_default_np(&attr);
-	if (s != 0) cleanup(SRC_PTHATTR);
-	pthread_attr_destroy(&attr); */
-	
-	// main server loop (exited via interrupt)
-	while (1) {
-		// wait for connection
-		struct sockaddr_in cli_addr = {0};
-		socklen_t addrlen = sizeof(struct sockaddr_in);
-		int csock = -1;
-		do {
-			csock = accept4(asock, &cli_addr, &addrlen, 0);
-		} while (csock == -1 && errno == EINTR);
-		if (csock == -1) cleanup(SRC_ACCEPT);
-		assert(addrlen <= sizeof(struct sockaddr_in));
-
-		if (ofd == -1) {
-			ofd = open(outpath, O_RDWR);
-			if (ofd == -1) cleanup(SRC_OPEN);
-		}
-
-		// give connection to thread
-		struct node* newnode = malloc(sizeof(struct node));		
-		newnode->next = thread_ll;
-		thread_ll = newnode;
-		newnode->c.sock = csock;
-		newnode->c.addr = cli_addr.sin_addr;
-		pthread_sigmask(SIG_BLOCK, &fullmask, NULL); // this thread handles all signals
-		s = pthread_create(&newnode->tid, NULL, client_thread, &newnode->c);
-		pthread_sigmask(SIG_UNBLOCK, &fullmask, NULL);
-		if (s != 0) cleanup_errno(SRC_PTHCR, s);
+// append to the output: space is reserved by bumping the active segment's tail, copied in
+// parallel with other appenders, then committed to of_sz in reservation order
+// returns the committed output length
+static size_t of_append (const struct iovec* iov, int niov, cleanup_fn die) {
+	size_t sz = 0;
+	for (int i = 0; i < niov; ++i)
+		sz += iov[i].iov_len;
+	of_rdlock(); // keeps the segment from being retired (and its mapping from moving)
+	struct segment* sg = of_active;
+	size_t off = atomic_load(&sg->tail);
+	do {
+		while (off + sz > sg->cap) { // full (or sealed by someone else), move on
+			pthread_rwlock_unlock(&of_maplk);
+			of_roll(sg, sz, die);
+			of_rdlock();
+			sg = of_active;
+			off = atomic_load(&sg->tail);
+		}
+	} while (!atomic_compare_exchange_weak(&sg->tail, &off, off + sz));
+	if (off + sz > sg->memsz) { // only an unsegmented file grows
+		pthread_rwlock_unlock(&of_maplk);
+		of_grow(sg, off + sz, die);
+		of_rdlock();
+	}
+	for (size_t i = 0, at = off; i < (size_t) niov; at += iov[i++].iov_len)
+		memcpy(sg->mem + at, iov[i].iov_base, iov[i].iov_len);
+	pthread_rwlock_unlock(&of_maplk);
+	stat_add(ST_BYTES_COPIED, sz);
 
-		// check for completed threads
-		struct node* p = NULL;
-		for (struct node* n = thread_ll; n; n = (p) ? p->next : thread_ll) {
-			s = pthread_tryjoin_np(n->tid, NULL);
-			if (s == 0) {
-				if (p) p->next = n->next;
-				else thread_ll = n->next;
-				free(n);
-			} else if (s != EBUSY) {
-				cleanup_errno(SRC_PTHJN, s);
-			} else p = n;
+	// wait for earlier reservations to land so readers never see a hole
+	size_t start = sg->base + off, end = start + sz;
+	if (atomic_load_explicit(&of_sz, memory_order_acquire) != start) {
+		uint64_t t = now_ns();
+		while (atomic_load_explicit(&of_sz, memory_order_acquire) != start) {
+			pthread_testcancel();
+			sched_yield();
 		}
+		stat_hist(SH_LOCK_WAIT, now_ns() - t);
 	}
+	idx_add(end, die); // the only committer until of_sz moves on
+	atomic_store(&of_sz, end); // sequentially consistent: followers arm their poke, then look at it
+	if (atomic_load_explicit(&nfollowers, memory_order_relaxed)) follow_wake(false);
+	return end;
+}
+
+static void unlock_mutex (void* lk) {
+	pthread_mutex_unlock((pthread_mutex_t*) lk);
+}
+
+// ask for a flush covering the output up to upto (group commit)
+static void of_sync_request (size_t upto) {
+	pthread_mutex_lock(&sync_lk);
+	if (upto > of_sync_want) {
+		of_sync_want = upto;
+		pthread_cond_signal(&sync_req);
+	}
+	pthread_mutex_unlock(&sync_lk);
+}
+
+// wait until the output up to upto is on disk (group commit, blocking callers)
+static void of_sync_wait (size_t upto) {
+	of_sync_request(upto);
+	pthread_mutex_lock(&sync_lk);
+	pthread_cleanup_push(unlock_mutex, &sync_lk);
+	while (atomic_load(&of_durable) < upto)
+		pthread_cond_wait(&sync_done, &sync_lk);
+	pthread_cleanup_pop(1);
+}
+
+// background flusher: periodic writeback (-D async), or one fdatasync for every batch of
+// appenders waiting on it (-D group), however many arrived while the last one ran
+static void* syncer (void* unused) {
+	size_t done = atomic_load(&of_durable);
+	while (1) {
+		if (durability == DUR_ASYNC) {
+			struct timespec ts = {.tv_sec = writeback_ms/1000, .tv_nsec = (writeback_ms%1000)*1000000L};
+			nanosleep(&ts, NULL);
+			// msync(MS_ASYNC) doesn't start writeback on Linux, so kick it for the new range directly
+			size_t end = atomic_load(&of_sz);
+			if (end > done) { // sealed segments were kicked when they filled up
+				struct segment* sg = seg_get_end(&seg_last);
+				size_t from = (done > sg->base) ? done - sg->base : 0;
+				int s = sync_file_range(sg->fd, from, 0, SYNC_FILE_RANGE_WRITE);
+				seg_put(sg);
+				if (s == -1) cleanup_thr(SRC_SYNC);
+				stat_add(ST_FLUSHES, 1);
+			}
+			done = end;
+			continue;
+		}
+
+		pthread_mutex_lock(&sync_lk);
+		pthread_cleanup_push(unlock_mutex, &sync_lk);
+		while (of_sync_want <= done)
+			pthread_cond_wait(&sync_req, &sync_lk);
+		pthread_cleanup_pop(1);
+
+		size_t end = atomic_load(&of_sz); // covers everyone committed so far, not just the asker
+		struct segment* sg = seg_get_end(&seg_last); // sealed segments were flushed when they filled up
+		int s = fdatasync(sg->fd);
+		seg_put(sg);
+		if (s == -1) cleanup_thr(SRC_SYNC);
+		done = end;
+		stat_add(ST_FLUSHES, 1);
+
+		pthread_mutex_lock(&sync_lk);
+		atomic_store(&of_durable, end);
+		pthread_cond_broadcast(&sync_done);
+		pthread_mutex_unlock(&sync_lk);
+		uint64_t one = 1;
+		for (int i = 0; i < nworkers; ++i)
+			if (workers[i].wakefd != -1 && write(workers[i].wakefd, &one, sizeof(one)) == -1)
+				cleanup_thr(SRC_SYNC);
+	}
+	return NULL;
+}
+#else
+// drop a mirrored record reference, freeing it after the last one
+static void mrec_put (struct mrec* r) {
+	if (atomic_fetch_sub(&r->refs, 1) == 1) free(r);
+}
+
+// account for a record the device now holds, and mirror it (under of_lk)
+static void of_track (const char* rec, size_t sz, cleanup_fn die) {
+	if (of_evicts && of_mirrored) { // in step with the driver: the newest record takes the oldest one's place
+		struct mrec** slot = &of_mirror[of_nwrites % CHRDEV_ENTRIES];
+		if (*slot) {
+			of_devsz -= (*slot)->sz;
+			mrec_put(*slot);
+		}
+		if (!(*slot = malloc(sizeof(struct mrec) + sz))) die(SRC_MALLOC);
+		(*slot)->refs = 1;
+		(*slot)->sz = sz;
+		memcpy((*slot)->data, rec, sz);
+		stat_add(ST_BYTES_COPIED, sz);
+	}
+	++of_nwrites;
+	of_devsz += sz;
+}
+
+// (re)load the mirror with the records the device holds (under of_lk, or before anyone uses it)
+// the driver keeps an entry per write but reads back as one stream, so the mirror takes each line
+// for an entry; more lines than entries, or an unterminated one, means something wrote around the
+// server with several lines to a write (or none), and the mirror gives up for good
+static void of_mirror_load (int fd, cleanup_fn die) {
+	for (int i = 0; i < CHRDEV_ENTRIES; ++i) {
+		if (of_mirror[i]) mrec_put(of_mirror[i]);
+		of_mirror[i] = NULL;
+	}
+	of_nwrites = of_devsz = 0;
+	size_t cap = REPLY_CHUNK, len = 0;
+	char* buf = malloc(cap);
+	ssize_t n = 0;
+	while (buf && (n = pread(fd, buf + len, cap - len, len)) > 0) {
+		len += n;
+		if (len == cap && !(buf = realloc(buf, cap *= 2))) break;
+	}
+	if (!buf) die(SRC_MALLOC);
+	if (n == -1) die(SRC_C_READ);
+	char *p = buf, *end = buf + len, *nl;
+	for (; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1)
+		of_track(p, nl + 1 - p, die);
+	free(buf);
+	if (p == end && of_nwrites <= CHRDEV_ENTRIES) return;
+	logmsg(LOG_WARNING, LM_WARN, "Device holds records the server can't tell apart, reading it for every reply");
+	of_mirrored = false;
+	for (int i = 0; i < CHRDEV_ENTRIES; ++i) {
+		if (of_mirror[i]) mrec_put(of_mirror[i]);
+		of_mirror[i] = NULL;
+	}
+}
+
+// check the device still holds what the mirror does (under of_lk): the driver has no generation
+// count, but a record written around the server shows up at the tail, after (or in place of) ours
+static bool of_probe (void) {
+	struct mrec* newest = (of_nwrites) ? of_mirror[(of_nwrites - 1) % CHRDEV_ENTRIES] : NULL;
+	size_t k = (!newest) ? 0 : (newest->sz < PROBE_MAX) ? newest->sz : PROBE_MAX;
+	char buf[PROBE_MAX + 1];
+	ssize_t n = pread(ofd, buf, k + 1, of_devsz - k);
+	return n == (ssize_t) k && (!k || memcmp(buf, newest->data + newest->sz - k, k) == 0);
+}
+
+// open the device on first use and learn the records it already holds
+static void of_open (cleanup_fn die) {
+	pthread_mutex_lock(&of_openlk);
+	if (ofd == -1) {
+		int fd = open(outpath, O_RDWR);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			pthread_mutex_unlock(&of_openlk);
+			die(SRC_OPEN);
+		}
+		of_evicts = S_ISCHR(st.st_mode);
+		if (!of_evicts) { // a plain file just grows (the driver appends whatever the offset), and isn't mirrored
+			of_devsz = st.st_size;
+			lseek(fd, 0, SEEK_END);
+		}
+		else of_mirror_load(fd, die);
+		ofd = fd;
+	}
+	pthread_mutex_unlock(&of_openlk);
+}
+#endif
+
+//-----client connections-----
+
+// (re)allocate a connection buffer, counting allocations
+static void* buf_realloc (void* buf, size_t sz) {
+	void* nb = realloc(buf, sz);
+	if (nb) atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+	return nb;
+}
+
+// free a connection buffer, counting frees
+static void buf_free (void* buf) {
+	if (!buf) return;
+	free(buf);
+	atomic_fetch_add_explicit(&nfrees, 1, memory_order_relaxed);
+}
+
+// set up connection state for a newly accepted socket
+static void conn_init (struct conn* c, struct client cl, bool nonblock) {
+	memset(c, 0, offsetof(struct conn, packet)); // buffers are kept from the last connection
+	int sock = c->sock = cl.sock;
+	c->addr = cl.addr;
+	c->local = cl.local;
+	c->nonblock = nonblock;
+	c->state = CS_RECV;
+	if (conn_socks && sock < conn_socks_max) atomic_store_explicit(&conn_socks[sock], true, memory_order_relaxed);
+
+	// bound what the kernel holds for a slow reader, and how long a blocking send waits on one
+	if (conn_sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &(int) {conn_sndbuf}, sizeof(int)) == -1)
+		logmsg(LOG_WARNING, LM_WARN, "Couldn't limit send buffer: %s", strerror(errno));
+	struct timeval tv = {.tv_sec = send_timeout};
+	if (!nonblock && send_timeout && setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+		logmsg(LOG_WARNING, LM_WARN, "Couldn't set send timeout: %s", strerror(errno));
+	tv.tv_sec = idle_timeout;
+	if (!nonblock && idle_timeout && setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+		logmsg(LOG_WARNING, LM_WARN, "Couldn't set idle timeout: %s", strerror(errno));
+
+	// log accepted connection
+	stat_add(ST_CONNS, 1);
+	if (cl.local) {
+		stat_add(ST_LOCAL_CONNS, 1);
+		struct ucred cred = {0};
+		getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &(socklen_t) {sizeof(cred)});
+		snprintf(c->cip, sizeof(c->cip), "local pid %d", (int) cred.pid);
+	} else inet_ntop(AF_INET, &cl.addr, c->cip, sizeof(c->cip));
+	logmsg(LOG_INFO, LM_ACCEPT, "Accepted connection from %s", c->cip);
+}
+
+// let go of the segment (or the mirrored records) a reply was being sent from
+static void conn_unref (struct conn* c) {
+#ifndef USE_AESD_CHAR_DEVICE
+	if (c->seg) seg_put(c->seg);
+	c->seg = NULL;
+#else
+	for (unsigned i = 0; i < c->nsnap; ++i)
+		mrec_put(c->snap[i]);
+	c->nsnap = 0;
+#endif
+}
+
+// release connection buffers (also used as a cancellation handler)
+static void conn_release (void* c_v) {
+	struct conn* c = (struct conn*) c_v;
+	conn_unref(c);
+	buf_free(c->packet);
+	buf_free(c->reply);
+	c->packet = c->reply = NULL;
+	c->max_packet = c->reply_cap = 0;
+	if (c->sock != -1) close(c->sock);
+	c->sock = -1;
+}
+
+// free buffers that one big packet or reply pushed past the high-water mark
+static void conn_trim (struct conn* c) {
+	if (c->max_packet > buf_trim) {
+		buf_free(c->packet);
+		c->packet = NULL;
+		c->max_packet = 0;
+		atomic_fetch_add_explicit(&ntrims, 1, memory_order_relaxed);
+	}
+	if (c->reply_cap > buf_trim) {
+		buf_free(c->reply);
+		c->reply = NULL;
+		c->reply_cap = 0;
+		atomic_fetch_add_explicit(&ntrims, 1, memory_order_relaxed);
+	}
+}
+
+// take a connection off the list it waits on (if any)
+static void conn_unwatch (struct conn* c) {
+	if (!c->list) return;
+	if (c->wprev) c->wprev->wnext = c->wnext;
+	else *c->list = c->wnext;
+	if (c->wnext) c->wnext->wprev = c->wprev;
+	c->list = NULL;
+}
+
+// put a connection on the list at *head (moving it from any other); for a reply or request waiting
+// on its client, every call counts as progress
+static void conn_watch (struct conn** head, struct conn* c) {
+	c->watch_at = now_ns();
+	if (c->list == head) return;
+	conn_unwatch(c);
+	c->list = head;
+	c->wprev = NULL;
+	c->wnext = *head;
+	if (*head) (*head)->wprev = c;
+	*head = c;
+}
+
+// has a watched connection gone without progress for longer than secs
+static bool conn_stalled (struct conn* c, uint64_t now, unsigned secs) {
+	return now - c->watch_at >= (uint64_t) secs*1000000000;
+}
+
+// give up on a client that stopped reading its reply
+static void conn_slow (struct conn* c) {
+	logmsg(LOG_WARNING, LM_WARN, "Dropping slow client %s: reply stalled at %zu of %zu bytes", c->cip, c->reply_off, c->reply_sz);
+	stat_add(ST_SLOW, 1);
+	c->state = CS_DONE;
+}
+
+// give up on a client that has sent nothing for the idle timeout
+static void conn_idle (struct conn* c) {
+	logmsg(LOG_WARNING, LM_WARN, "Dropping idle client %s after %us", c->cip, idle_timeout);
+	stat_add(ST_IDLE, 1);
+	c->state = CS_DONE;
+}
+
+// a connection's socket is about to be closed: a handoff mustn't touch it any more
+static void conn_forget (struct conn* c) {
+	if (conn_socks && c->sock < conn_socks_max) atomic_store_explicit(&conn_socks[c->sock], false, memory_order_relaxed);
+}
+
+// connection socket has been closed, keep its buffers for the next one
+static void conn_closed (struct conn* c) {
+	c->sock = -1;
+	atomic_fetch_sub_explicit(&nconns, 1, memory_order_relaxed);
+	if (c->follow) atomic_fetch_sub_explicit(&nfollowers, 1, memory_order_relaxed);
+	conn_unref(c);
+	conn_trim(c);
+	logmsg(LOG_INFO, LM_CLOSE, "Closed connection from %s", c->cip);
+}
+
+// close connection
+static void conn_close (struct conn* c) {
+	conn_forget(c);
+	if (close(c->sock) == -1) // the connection is gone either way
+		logmsg(LOG_WARNING, LM_WARN, "Error closing connection from %s: %s", c->cip, strerror(errno));
+	conn_closed(c);
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+static _Thread_local uint64_t of_lk_since; // when this thread took of_lk
+#endif
+
+// begin a batch of stores (chrdev writes and their readback are serialised by of_lk)
+static void store_begin (void) {
+#ifdef USE_AESD_CHAR_DEVICE
+	uint64_t t = now_ns();
+	pthread_mutex_lock(&of_lk);
+	of_lk_since = now_ns();
+	stat_hist(SH_LOCK_WAIT, of_lk_since - t);
+#endif
+}
+
+// end a batch of stores
+static void store_end (void) {
+#ifdef USE_AESD_CHAR_DEVICE
+	uint64_t held = now_ns() - of_lk_since;
+	pthread_mutex_unlock(&of_lk);
+	stat_hist(SH_LOCK_HOLD, held);
+#endif
+}
+
+// append one record to the output (inside store_begin/store_end), a framed one (rec is its header)
+// gets its marker and newline around it; returns the output length just after the record
+static size_t store_record (const char* rec, size_t sz, bool framed) {
+#ifdef USE_AESD_CHAR_DEVICE
+	// write record to buffer
+	size_t wrsz = sz;
+	const char* wrpt = rec;
+	ssize_t wrc;
+	do {
+		wrc = write(ofd, wrpt, wrsz);
+		wrsz -= wrc;
+		wrpt += wrc;
+	} while (wrsz > 0 && wrc != -1);
+	if (wrc == -1) cleanup_thr(SRC_C_WRITE);
+	of_track(rec, sz, cleanup_thr);
+	of_sz += sz;
+	logmsg(LOG_INFO, LM_PACKET, "Got packet of length %zu from client, new file length %zu", sz, (size_t) of_sz);
+	return of_sz;
+#else
+	struct iovec iov[3] = {{.iov_base = &(char) {FRAME_MARK}, .iov_len = 1}, {.iov_base = (char*) rec, .iov_len = sz},
+		{.iov_base = "\n", .iov_len = 1}};
+	return (framed) ? of_append(iov, 3, cleanup_thr) : of_append(&iov[1], 1, cleanup_thr);
+#endif
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+// fill the reply buffer from a plain output file, starting at reply_off (under of_lk);
+// returns false if the file is shorter than the reply
+static bool conn_refill (struct conn* c) {
+	size_t want = c->reply_sz - c->reply_off;
+	if (want > c->reply_cap) want = c->reply_cap;
+	size_t got = 0;
+	while (got < want) {
+		ssize_t rdc = pread(ofd, c->reply + got, want - got, c->reply_off + got);
+		if (rdc == -1) cleanup_thr(SRC_C_READ);
+		if (rdc == 0) break;
+		got += rdc;
+	}
+	stat_add(ST_BYTES_COPIED, got);
+	c->reply_lo = c->reply_off;
+	c->reply_len = got;
+	return got == want;
+}
+#endif
+
+// take a snapshot of the output for the reply (inside store_begin/store_end)
+static void conn_snapshot (struct conn* c) {
+#ifdef USE_AESD_CHAR_DEVICE
+	// the reply holds on to the mirrored records, so it's sent as the device was even if they're evicted
+	conn_unref(c);
+	c->reply_off = 0;
+	c->state = CS_SEND;
+	if (of_evicts && of_mirrored && !of_probe()) {
+		logmsg(LOG_WARNING, LM_WARN, "Device changed outside the server, reloading it");
+		of_mirror_load(ofd, cleanup_thr);
+		stat_add(ST_RELOADS, 1);
+	}
+	if (of_evicts && of_mirrored) {
+		c->nsnap = (of_nwrites < CHRDEV_ENTRIES) ? of_nwrites : CHRDEV_ENTRIES;
+		for (unsigned i = 0; i < c->nsnap; ++i) {
+			c->snap[i] = of_mirror[(of_nwrites - c->nsnap + i) % CHRDEV_ENTRIES];
+			atomic_fetch_add(&c->snap[i]->refs, 1);
+		}
+		c->reply_sz = of_devsz;
+		return;
+	}
+	if (of_evicts) { // a device the mirror can't follow is read whole (it holds CHRDEV_ENTRIES records at most)
+		size_t len = 0;
+		ssize_t n;
+		do {
+			if (len == c->reply_cap) {
+				size_t cap = (c->reply_cap) ? c->reply_cap*2 : REPLY_CHUNK;
+				char* nr = buf_realloc(c->reply, cap);
+				if (!nr) cleanup_thr(SRC_MALLOC);
+				c->reply = nr;
+				c->reply_cap = cap;
+			}
+			n = pread(ofd, c->reply + len, c->reply_cap - len, len);
+			if (n == -1) cleanup_thr(SRC_C_READ);
+			len += n;
+		} while (n);
+		stat_add(ST_BYTES_COPIED, len);
+		c->reply_lo = 0;
+		c->reply_len = c->reply_sz = len;
+		return;
+	}
+
+	// a plain file isn't mirrored, the reply streams from it a buffer at a time
+	if (!c->reply) {
+		c->reply = buf_realloc(NULL, REPLY_CHUNK);
+		if (!c->reply) cleanup_thr(SRC_MALLOC);
+		c->reply_cap = REPLY_CHUNK;
+	}
+	c->reply_sz = of_devsz;
+	if (!conn_refill(c)) {
+		logmsg(LOG_WARNING, LM_WARN, "Read fewer bytes from device than expected: %zu of %zu", c->reply_len, c->reply_sz);
+		c->reply_sz = c->reply_len;
+	}
+#else
+	// send the retained output to client, up to its own records, walking the segments from the oldest
+	conn_unref(c);
+	c->seg = seg_get_end(&seg_first);
+	c->reply_sz = c->stored_sz;
+	c->reply_off = (c->seg->base < c->reply_sz) ? c->seg->base : c->reply_sz;
+	c->state = (durability == DUR_GROUP && atomic_load(&of_durable) < c->stored_sz) ? CS_SYNC : CS_SEND;
+#endif
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+// move the reply on to the segment holding reply_off and find how much of the reply it has;
+// returns false if retention retired the segment before the client got to it
+static bool conn_span (struct conn* c, size_t* len) {
+	while (c->reply_off < c->reply_sz && c->reply_off >= atomic_load(&c->seg->end)) {
+		struct segment* next = seg_get(c->seg->seq + 1);
+		conn_unref(c);
+		if (!next) {
+			logmsg(LOG_WARNING, LM_WARN, "Dropping %s: reply retired before it was sent", c->cip);
+			return false;
+		}
+		c->seg = next;
+	}
+	size_t end = atomic_load(&c->seg->end);
+	*len = ((end < c->reply_sz) ? end : c->reply_sz) - c->reply_off;
+	return true;
+}
+
+// match a command name at *p, moving past it
+static bool cmd_is (const char** p, const char* end, const char* name) {
+	size_t n = strlen(name);
+	if ((size_t) (end - *p) < n || memcmp(*p, name, n) != 0) return false;
+	*p += n;
+	return true;
+}
+
+// parse a command's decimal argument up to the stop character, moving past both
+static bool cmd_num (const char** p, const char* end, char stop, size_t* v) {
+	const char* q = *p;
+	if (q == end || *q < '0' || *q > '9') return false;
+	for (*v = 0; q < end && *q >= '0' && *q <= '9'; ++q) {
+		if (*v > (SIZE_MAX - 9)/10) return false;
+		*v = *v*10 + (*q - '0');
+	}
+	if (q == end || *q != stop) return false;
+	*p = q + 1;
+	return true;
+}
+
+// the command a record is, with its arguments (CMD_NONE if it isn't exactly one)
+static enum command cmd_parse (const char* rec, size_t sz, size_t* a, size_t* b) {
+	const char* end = rec + sz;
+	if (sz <= strlen(CMD_PREFIX) || memcmp(rec, CMD_PREFIX, strlen(CMD_PREFIX)) != 0) return CMD_NONE;
+	const char* p = rec; // only moves past a name that matched, and no name starts another
+	if (cmd_is(&p, end, CMD_BINARY) && p + 1 == end && *p == '\n') return CMD_IS_BINARY;
+	if (cmd_is(&p, end, CMD_TAIL) && cmd_num(&p, end, '\n', a) && p == end) return CMD_IS_TAIL;
+	if (cmd_is(&p, end, CMD_FOLLOW) && cmd_num(&p, end, '\n', a) && p == end) return CMD_IS_FOLLOW;
+	if (cmd_is(&p, end, CMD_FROM) && cmd_num(&p, end, '\n', a) && p == end) return CMD_IS_FROM;
+	if (cmd_is(&p, end, CMD_RANGE) && cmd_num(&p, end, ',', a) && cmd_num(&p, end, '\n', b) && p == end) return CMD_IS_RANGE;
+	return CMD_NONE;
+}
+
+// answer a command with the part of the output it asks for
+static void conn_command (struct conn* c, enum command cmd, size_t a, size_t b) {
+	if (cmd == CMD_IS_BINARY) { // nothing to send back
+		c->binary = true;
+		return;
+	}
+
+	conn_unref(c);
+	of_rdlock();
+	size_t out_sz = atomic_load(&of_sz), first = atomic_load(&of_first);
+	size_t n = atomic_load_explicit(&idx_n, memory_order_acquire);
+	while (n > idx_first && idx_start(n) > out_sz) --n; // indexed, but not committed yet
+	size_t lo = first, hi = first;
+	switch (cmd) {
+		case CMD_IS_TAIL:
+		case CMD_IS_FOLLOW:
+			lo = idx_start((a < n - idx_first) ? n - a : idx_first);
+			hi = idx_start(n);
+			break;
+		case CMD_IS_FROM:
+			lo = idx_start((a < idx_first) ? idx_first : (a > n) ? n : a);
+			hi = idx_start(n);
+			break;
+		case CMD_IS_RANGE:
+			lo = (a < first) ? first : (a > out_sz) ? out_sz : a;
+			hi = (b > out_sz - lo) ? out_sz : lo + b;
+			break;
+		default:
+			break;
+	}
+
+	// the reply starts in the last segment that begins at or before lo
+	unsigned long s_lo = seg_first, s_hi = seg_last;
+	while (s_lo < s_hi) {
+		unsigned long mid = s_hi - (s_hi - s_lo)/2;
+		if (segs[mid % SEG_SLOTS]->base <= lo) s_lo = mid;
+		else s_hi = mid - 1;
+	}
+	c->seg = segs[s_lo % SEG_SLOTS];
+	atomic_fetch_add(&c->seg->refs, 1);
+	pthread_rwlock_unlock(&of_maplk);
+
+	c->reply_off = lo;
+	c->reply_sz = hi;
+	c->state = CS_SEND;
+	++c->ncmds;
+	if (cmd == CMD_IS_FOLLOW && !c->follow) { // from here on it only sends (anything else it sends is ignored)
+		c->follow = true;
+		atomic_fetch_add_explicit(&nfollowers, 1, memory_order_relaxed);
+	}
+}
+#endif
+
+// hold a reply until its records are on disk; returns false if a nonblocking connection has to wait
+static bool conn_sync (struct conn* c) {
+#ifndef USE_AESD_CHAR_DEVICE
+	if (atomic_load(&of_durable) < c->stored_sz) {
+		if (c->nonblock) {
+			of_sync_request(c->stored_sz);
+			return false;
+		}
+		of_sync_wait(c->stored_sz);
+	}
+#endif
+	c->state = CS_SEND;
+	return true;
+}
+
+// a follower has been sent all the output: carry on once more is committed; returns false if it
+// has to wait (its thread arms a poke first, and tries again, watching for a hangup meanwhile)
+// a pool worker never waits: it hands the follower to the follow worker instead
+static bool conn_follow (struct conn* c) {
+#ifndef USE_AESD_CHAR_DEVICE
+	size_t end = atomic_load(&of_sz);
+	if (!atomic_load(&draining)) {
+		if (!c->nonblock || end <= c->reply_sz) return false;
+		c->reply_sz = end;
+		c->state = CS_SEND;
+		return true;
+	}
+#endif
+	c->state = CS_DONE; // handing off
+	return true;
+}
+
+// a request has been answered (or stored, without replies): record its latency
+static void conn_answered (struct conn* c) {
+	if (!c->req_start) return;
+	uint64_t now = now_ns();
+	stat_hist(SH_LATENCY, now - c->req_start);
+	if (c->local) stat_hist(SH_LOCAL_LATENCY, now - c->req_start);
+	c->req_start = (c->packet_sz > c->rec_start) ? now : 0; // the rest of the buffer is the next request
+}
+
+// length of the binary frame at the start of the unstored data (0 until its header is in)
+static size_t conn_frame (struct conn* c) {
+	if (c->packet_sz - c->rec_start < FRAME_HDR) return 0;
+	uint32_t len;
+	memcpy(&len, &c->packet[c->rec_start], FRAME_HDR);
+	return FRAME_HDR + (size_t) ntohl(len);
+}
+
+// room to make before receiving: the rest of a binary frame, so it fits without growing again
+// (up to a point: the header is only the client's word, a big frame grows as it arrives)
+static size_t conn_want (struct conn* c) {
+	size_t frame = (c->binary) ? conn_frame(c) : 0, have = c->packet_sz - c->rec_start;
+	return (frame <= have) ? 1 : (frame - have < FRAME_RESERVE_MAX) ? frame - have : FRAME_RESERVE_MAX;
+}
+
+// store complete records from the packet buffer, scanning each byte only once (frames aren't scanned)
+static void conn_records (struct conn* c) {
+	bool batch = false, cmd_next = false;
+	size_t oversize = 0; // limit a record went over
+	while (c->state == CS_RECV && c->scan_off < c->packet_sz) {
+		size_t end, skip = 0; // skip: frame header before the payload
+		if (c->binary) {
+			size_t sz = conn_frame(c);
+			size_t limit = (max_record) ? max_record : DEFAULT_MAX_FRAME;
+			if (sz > FRAME_HDR + limit) { // refused before it's read
+				oversize = limit;
+				break;
+			}
+			if (!sz || c->packet_sz - c->rec_start < sz) break;
+			end = c->rec_start + sz;
+			skip = FRAME_HDR;
+		} else {
+			char* delim = memchr(&c->packet[c->scan_off], '\n', c->packet_sz - c->scan_off);
+			if (!delim) {
+				c->scan_off = c->packet_sz;
+				if (max_record && c->packet_sz - c->rec_start > max_record) oversize = max_record; // before it grows any more
+				break;
+			}
+			end = delim - c->packet + 1;
+		}
+		size_t rec_sz = end - c->rec_start - skip;
+		if (max_record && rec_sz > max_record) {
+			oversize = max_record;
+			break;
+		}
+#ifndef USE_AESD_CHAR_DEVICE
+		size_t a = 0, b = 0;
+		enum command cmd = cmd_parse(&c->packet[c->rec_start + skip], rec_sz, &a, &b);
+		if (cmd != CMD_NONE) {
+			if (batch) { // answer the records before it first
+				cmd_next = true;
+				break;
+			}
+			conn_command(c, cmd, a, b);
+			c->rec_start = c->scan_off = end;
+			continue;
+		}
+#endif
+		if (!batch) store_begin();
+		batch = true;
+		c->stored_sz = store_record(&c->packet[c->rec_start], end - c->rec_start, c->binary);
+		stat_add(ST_RECORDS, 1);
+		if (c->local) stat_add(ST_LOCAL_RECORDS, 1);
+		stat_hist(SH_PACKET, rec_sz);
+		c->rec_start = c->scan_off = end;
+		++c->nrecords;
+		if (reply_policy == REPLY_RECORD) conn_snapshot(c); // reply before storing any more
+	}
+	if (batch) {
+		if (reply_policy == REPLY_BATCH) conn_snapshot(c);
+		store_end();
+		if (reply_policy == REPLY_NONE) conn_answered(c);
+	}
+	if (oversize) { // whatever it stored before that isn't answered
+		logmsg(LOG_WARNING, LM_WARN, "Dropping %s: record over %zu bytes", c->cip, oversize);
+		stat_add(ST_OVERSIZE, 1);
+		c->state = CS_DONE;
+		return;
+	}
+	if (cmd_next && c->state == CS_RECV) { // nothing to send for the records, go straight on
+		conn_records(c);
+		return;
+	}
+
+	// without keep-alive (or while handing off), a connection is done after its first batch (or command)
+	if (c->state == CS_RECV && (c->nrecords || c->ncmds) && (!keepalive || atomic_load_explicit(&draining, memory_order_relaxed)))
+		c->state = CS_DONE;
+}
+
+// make room for at least need more bytes in the packet buffer; returns false (and drops the client)
+// if there's no memory for it
+static bool conn_reserve (struct conn* c, size_t need) {
+	if (c->rec_start) { // drop stored records from the buffer
+		memmove(c->packet, &c->packet[c->rec_start], c->packet_sz - c->rec_start);
+		stat_add(ST_BYTES_COPIED, c->packet_sz - c->rec_start);
+		c->packet_sz -= c->rec_start;
+		c->scan_off -= c->rec_start;
+		c->rec_start = 0;
+	}
+	if (c->max_packet - c->packet_sz < need) { // need to expand buffer (straight to size for a big frame)
+		size_t new_max = (c->max_packet) ? c->max_packet*2 : INITIAL_MAX_PACKET;
+		if (new_max - c->packet_sz < need) new_max = c->packet_sz + need;
+		char* np = buf_realloc(c->packet, new_max);
+		if (!np) {
+			logmsg(LOG_WARNING, LM_WARN, "Dropping %s: no memory for a %zu byte buffer", c->cip, new_max);
+			c->state = CS_DONE;
+			return false;
+		}
+		c->packet = np;
+		c->max_packet = new_max;
+	}
+	return true;
+}
+
+// new data is in the packet buffer
+static void conn_received (struct conn* c, size_t sz) {
+	stat_add(ST_BYTES_IN, sz);
+	if (!c->req_start) c->req_start = now_ns();
+	c->packet_sz += sz;
+	conn_records(c);
+}
+
+// the whole reply has been sent
+static void conn_replied (struct conn* c) {
+	conn_answered(c);
+	if (c->follow) { // wait for more, still holding its segment
+		c->req_start = 0;
+		c->state = CS_FOLLOW;
+		return;
+	}
+	conn_unref(c);
+
+	// carry on with any records left in the buffer
+	c->state = CS_RECV;
+	conn_records(c);
+}
+
+// read from client and store any complete records; returns false if the socket would block
+static bool conn_recv (struct conn* c) {
+	if (!conn_reserve(c, conn_want(c))) return true;
+
+	ssize_t read_sz = read(c->sock, &c->packet[c->packet_sz], c->max_packet - c->packet_sz);
+	if (read_sz == -1) {
+		if (errno == EINTR) return true;
+		if ((errno == EAGAIN || errno == EWOULDBLOCK) && !c->nonblock) { // a blocking read ran out of SO_RCVTIMEO
+			conn_idle(c);
+			return true;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+		if (errno == ECONNRESET) {
+			c->state = CS_DONE;
+			return true;
+		}
+		cleanup_thr(SRC_READ);
+	} else if (read_sz == 0) { // client hung up
+		if (c->packet_sz)
+			logmsg(LOG_WARNING, LM_WARN, "Connection from %s closed before end of packet", c->cip);
+		c->state = CS_DONE;
+		return true;
+	}
+
+	conn_received(c, read_sz);
+	return true;
+}
+
+// send reply to client; returns false if the socket would block
+static bool conn_send (struct conn* c) {
+	while (c->reply_off < c->reply_sz) {
+		size_t left = c->reply_sz - c->reply_off;
+		ssize_t wsz;
+#ifdef USE_AESD_CHAR_DEVICE
+		if (c->nsnap) { // straight from the mirrored records, whatever's left of them in one go
+			struct iovec iov[CHRDEV_ENTRIES];
+			int niov = 0;
+			size_t at = 0;
+			for (unsigned i = 0; i < c->nsnap; at += c->snap[i++]->sz) {
+				if (c->reply_off >= at + c->snap[i]->sz) continue;
+				size_t skip = (c->reply_off > at) ? c->reply_off - at : 0;
+				iov[niov++] = (struct iovec) {.iov_base = c->snap[i]->data + skip, .iov_len = c->snap[i]->sz - skip};
+			}
+			wsz = sendmsg(c->sock, &(struct msghdr) {.msg_iov = iov, .msg_iovlen = niov}, MSG_NOSIGNAL);
+		} else {
+			if (c->reply_off == c->reply_lo + c->reply_len) { // buffer sent, read the next part
+				store_begin(); // of_lk, only for the copy
+				bool ok = conn_refill(c);
+				store_end();
+				if (!ok) {
+					logmsg(LOG_WARNING, LM_WARN, "Dropping %s: output file truncated before the reply was sent", c->cip);
+					c->state = CS_DONE;
+					return true;
+				}
+			}
+			left = c->reply_lo + c->reply_len - c->reply_off;
+			wsz = send(c->sock, &c->reply[c->reply_off - c->reply_lo], left, MSG_NOSIGNAL);
+		}
+#else
+		if (!conn_span(c, &left)) {
+			c->state = CS_DONE;
+			return true;
+		}
+		struct segment* sg = c->seg;
+		if (use_sendfile) {
+			off_t off = c->reply_off - sg->base;
+			wsz = sendfile(c->sock, sg->fd, &off, left);
+			if (wsz == -1 && (errno == EINVAL || errno == ENOSYS)) { // not supported here
+				logmsg(LOG_WARNING, LM_WARN, "sendfile unavailable, falling back to mapping: %s", strerror(errno));
+				use_sendfile = false;
+				continue;
+			} else if (wsz == 0) { // file is shorter than it should be
+				logmsg(LOG_WARNING, LM_WARN, "Output file truncated at %zu of %zu bytes", c->reply_off, c->reply_sz);
+				break;
+			}
+		} else {
+			// an unsegmented mapping can move under a send, so it's only held while the socket takes what
+			// fits right away; a blocking connection waits for room with it released
+			of_rdlock();
+			wsz = send(c->sock, sg->mem + (c->reply_off - sg->base), left, MSG_NOSIGNAL | MSG_DONTWAIT);
+			int e = errno;
+			pthread_rwlock_unlock(&of_maplk);
+			errno = e;
+			if (wsz == -1 && !c->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				struct pollfd pfd = {.fd = c->sock, .events = POLLOUT};
+				if (poll(&pfd, 1, (send_timeout) ? (int) send_timeout*1000 : -1) != 0) continue; // room, or an error the next send reports
+				errno = EAGAIN; // out of time, as with SO_SNDTIMEO
+			}
+		}
+#endif
+		if (wsz == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (c->nonblock) return false; // partial send, resume at reply_off
+				conn_slow(c); // a blocking send ran out of SO_SNDTIMEO
+				return true;
+			}
+			if (errno == EPIPE || errno == ECONNRESET) {
+				c->state = CS_DONE;
+				return true;
+			}
+			cleanup_thr(SRC_WRITE);
+		}
+		c->reply_off += wsz;
+		stat_add(ST_BYTES_OUT, wsz);
+	}
+#ifdef USE_AESD_CHAR_DEVICE
+	logmsg(LOG_INFO, LM_SENT, "Sent full file back to client, length %zu", c->reply_sz);
+#endif
+	conn_replied(c);
+	return true;
+}
+
+// drive a connection until it is finished or its socket would block
+static void conn_run (struct conn* c) {
+	bool progress = true;
+	while (progress && c->state != CS_DONE)
+		progress = (c->state == CS_RECV) ? conn_recv(c) : (c->state == CS_SYNC) ? conn_sync(c) :
+			(c->state == CS_FOLLOW) ? conn_follow(c) : conn_send(c);
+}
+
+//-----pool workers-----
+
+// queue a connection for the pool (acceptors), waiting for a free slot
+static void workq_push (struct client cl) {
+	int s;
+	do {
+		s = sem_wait(&workq_free);
+	} while (s == -1 && errno == EINTR);
+
+	// teardown would deadlock on workq_lk if it interrupted us here
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_mutex_lock(&workq_lk);
+	workq[workq_tail] = cl;
+	workq_tail = (workq_tail + 1) % workq_cap;
+	pthread_mutex_unlock(&workq_lk);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	sem_post(&workq_items);
+}
+
+// take the next queued connection (blocks, cancellable)
+static struct client workq_pop (void) {
+	int s;
+	do {
+		s = sem_wait(&workq_items);
+	} while (s == -1 && errno == EINTR);
+
+	pthread_mutex_lock(&workq_lk);
+	struct client cl = workq[workq_head];
+	workq_head = (workq_head + 1) % workq_cap;
+	pthread_mutex_unlock(&workq_lk);
+	sem_post(&workq_free);
+	return cl;
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+// hand a follower to the follow worker, which waits on all of them for output (and hangups), so it
+// doesn't hold up a pool worker for as long as it follows; the buffers stay with the pool worker
+static void follow_hand (struct conn* c) {
+	struct conn* f = calloc(1, sizeof(struct conn));
+	if (!f || fcntl(c->sock, F_SETFL, O_NONBLOCK) == -1) {
+		logmsg(LOG_WARNING, LM_WARN, "Dropping follower %s: %s", c->cip, strerror(errno));
+		free(f);
+		conn_close(c);
+		return;
+	}
+	atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+	memcpy(f, c, offsetof(struct conn, packet));
+	f->nonblock = true;
+	f->events = EPOLLOUT | EPOLLRDHUP; // writable straight away, so the worker takes it up
+	struct epoll_event ev = {.events = f->events, .data.ptr = f};
+	if (epoll_ctl(follow_worker->epfd, EPOLL_CTL_ADD, f->sock, &ev) == -1) cleanup_thr(SRC_EPOLL);
+	c->sock = -1; // both are the follower's now
+	c->seg = NULL;
+}
+#endif
+
+static void* pool_worker (void* unused) {
+	struct conn c = {.sock = -1};
+	pthread_cleanup_push(conn_release, &c);
+	while (1) {
+		conn_init(&c, workq_pop(), false);
+		conn_run(&c);
+#ifndef USE_AESD_CHAR_DEVICE
+		if (c.state == CS_FOLLOW) follow_hand(&c);
+		else
+#endif
+		conn_close(&c);
+	}
+	pthread_cleanup_pop(0);
+	return NULL;
+}
+
+//-----epoll workers-----
+
+// take an idle connection from a worker's cache, or make a new one (the worker's acceptor only)
+static struct conn* conn_get (struct worker* w, cleanup_fn die) {
+	// each worker is fed by a single acceptor, the only popper, so a popped head can't come back
+	// mid-exchange (no ABA)
+	struct conn* c = atomic_load(&w->free_conns);
+	while (c && !atomic_compare_exchange_weak(&w->free_conns, &c, c->next));
+	if (c) {
+		atomic_fetch_sub_explicit(&w->nfree, 1, memory_order_relaxed);
+		return c;
+	}
+
+	c = calloc(1, sizeof(struct conn));
+	if (!c) die(SRC_MALLOC);
+	atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+	return c;
+}
+
+// return a closed connection to its worker's cache (worker thread only)
+static void conn_put (struct worker* w, struct conn* c) {
+	if (w == follow_worker || atomic_load_explicit(&w->nfree, memory_order_relaxed) >= CONN_CACHE_MAX) { // nobody takes from the follow worker's
+		conn_release(c);
+		buf_free(c);
+		return;
+	}
+	atomic_fetch_add_explicit(&w->nfree, 1, memory_order_relaxed);
+	c->next = atomic_load(&w->free_conns);
+	while (!atomic_compare_exchange_weak(&w->free_conns, &c->next, c));
+}
+
+// close a connection, keeping it out of the cache until the batch of events is done
+// (later events in it may still point at it; they see it closed and skip it)
+static void epoll_close (struct worker* w, struct conn* c) {
+	conn_close(c);
+	c->next = w->closed;
+	w->closed = c;
+}
+
+// hand a connection to an epoll worker
+// (with an idle timeout, its first event is for writing, so the worker starts watching it straight away)
+static void epoll_add (struct worker* w, struct conn* c, cleanup_fn die) {
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP | ((idle_timeout) ? EPOLLOUT : 0),
+		.data.ptr = c
+	};
+	c->events = ev.events;
+	int s = epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->sock, &ev);
+	if (s == -1) die(SRC_EPOLL);
+}
+
+// run a connection and wait for whatever it is blocked on next
+static void epoll_handle (struct worker* w, struct conn* c) {
+	conn_run(c);
+	while (c->state == CS_FOLLOW) { // arm the poke, then make sure nothing was committed meanwhile
+		atomic_store(&w->follow_armed, true);
+		if (atomic_load(&of_sz) <= c->reply_sz && !atomic_load(&draining)) break;
+		conn_run(c);
+	}
+	if (c->state == CS_SEND && send_timeout) conn_watch(&w->sending, c); // it only runs again once the client took some
+	else if (c->state == CS_FOLLOW) conn_watch(&w->following, c);
+	else if (c->state == CS_RECV && idle_timeout) conn_watch(&w->receiving, c); // only runs again once it sent some
+	else conn_unwatch(c);
+	if (c->state == CS_DONE) { // closing the socket removes it from the epoll set
+		epoll_close(w, c);
+		return;
+	}
+
+	uint32_t want = (c->state == CS_SEND) ? EPOLLOUT : (c->state == CS_FOLLOW) ? EPOLLRDHUP : EPOLLIN | EPOLLRDHUP;
+	if (c->state == CS_SYNC) { // the syncer's poke resumes it
+		c->parked = true;
+		c->next = w->parked;
+		w->parked = c;
+		want = 0;
+	}
+	if (want != c->events) {
+		struct epoll_event ev = {.events = want, .data.ptr = c};
+		int s = epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+		if (s == -1) cleanup_thr(SRC_EPOLL);
+		c->events = want;
+	}
+}
+
+// drop the worker's clients whose replies have stalled, or that went idle (checked about once a second)
+static void epoll_sweep (struct worker* w) {
+	uint64_t now = now_ns();
+	if (now - w->swept < SEND_SWEEP_NS) return;
+	w->swept = now;
+	for (int idle = 0; idle < 2; ++idle) {
+		for (struct conn *c = (idle) ? w->receiving : w->sending, *next; c; c = next) {
+			next = c->wnext;
+			if (!conn_stalled(c, now, (idle) ? idle_timeout : send_timeout)) continue;
+			conn_unwatch(c);
+			if (idle) conn_idle(c);
+			else conn_slow(c);
+			epoll_close(w, c);
+		}
+	}
+}
+
+static void* epoll_worker (void* param_v) {
+	struct worker* w = (struct worker*) param_v;
+	struct epoll_event evs[MAX_EVENTS];
+	while (1) {
+		int n = epoll_wait(w->epfd, evs, MAX_EVENTS, (send_timeout || idle_timeout) ? SEND_SWEEP_NS/1000000 : -1);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			cleanup_thr(SRC_EPOLL);
+		}
+
+		for (int i = 0; i < n; ++i) {
+			struct conn* c = (struct conn*) evs[i].data.ptr;
+			if (!c) { // a flush finished or output was committed, retry everyone waiting for either
+				uint64_t v;
+				if (read(w->wakefd, &v, sizeof(v)) == -1 && errno != EAGAIN) cleanup_thr(SRC_SYNC);
+				struct conn* p = w->parked;
+				w->parked = NULL;
+				while (p) {
+					struct conn* next = p->next;
+					p->parked = false;
+					epoll_handle(w, p);
+					p = next;
+				}
+				for (struct conn *f = w->following, *next; f; f = next) {
+					next = f->wnext;
+					epoll_handle(w, f);
+				}
+				continue;
+			}
+			if (c->sock == -1 || c->parked) continue; // closed earlier in this batch, or hangups are noticed once it's resumed
+			if (c->list == &w->following) c->state = CS_DONE; // nothing but a hangup wakes an idle follower
+			epoll_handle(w, c);
+		}
+		if (send_timeout || idle_timeout) epoll_sweep(w);
+		while (w->closed) { // no event refers to them any more
+			struct conn* c = w->closed;
+			w->closed = c->next;
+			conn_put(w, c);
+		}
+	}
+	return NULL;
+}
+
+//-----acceptors-----
+
+// count a new connection from addr against its allowance for this second; false once it's used up
+// (an address takes over a slot another was using, so sharing one errs towards admitting)
+static bool rate_take (struct in_addr addr) {
+	uint32_t ip = addr.s_addr;
+	uint64_t sec = (now_ns()/1000000000) & 0xffff;
+	_Atomic uint64_t* slot = &rate_slots[(uint32_t) (ip*2654435761u) >> (32 - RATE_BITS)];
+	uint64_t old = atomic_load_explicit(slot, memory_order_relaxed), next;
+	do {
+		uint64_t n = (old >> 32 == ip && ((old >> 16) & 0xffff) == sec) ? old & 0xffff : 0;
+		if (n >= conn_rate) return false;
+		next = (uint64_t) ip << 32 | sec << 16 | (n + 1);
+	} while (!atomic_compare_exchange_weak_explicit(slot, &old, next, memory_order_relaxed, memory_order_relaxed));
+	return true;
+}
+
+// take a just-accepted connection (counting it open), or shed it straight away when the server is
+// full or its address is connecting too often (local clients have no address to limit)
+static bool conn_admit (struct client* cl) {
+	int open = atomic_fetch_add_explicit(&nconns, 1, memory_order_relaxed);
+	bool full = max_conns && open >= max_conns;
+	if (!full && (!conn_rate || cl->local || rate_take(cl->addr))) return true;
+	atomic_fetch_sub_explicit(&nconns, 1, memory_order_relaxed);
+	stat_add((full) ? ST_SHED : ST_RATE_LIMITED, 1);
+	char cip[INET_ADDRSTRLEN] = "local";
+	if (!cl->local) inet_ntop(AF_INET, &cl->addr, cip, sizeof(cip));
+	logmsg(LOG_WARNING, LM_WARN, "Shedding connection from %s: %s", cip, (full) ? "too many open" : "connecting too often");
+	setsockopt(cl->sock, SOL_SOCKET, SO_LINGER, &(struct linger) {.l_onoff = 1}, sizeof(struct linger)); // reset, so it can't pass for a reply
+	close(cl->sock);
+	return false;
+}
+
+// accept a connection on a listener and hand it to the workers (the local listener is shared,
+// so it may already have been taken)
+static void accept_one (int idx, int lsock, int* next_worker, cleanup_fn die) {
+	struct sockaddr_in cli_addr = {0};
+	socklen_t addrlen = sizeof(struct sockaddr_in);
+	int csock = -1;
+	do {
+		csock = accept4(lsock, &cli_addr, &addrlen, (mode == MODE_EPOLL) ? SOCK_NONBLOCK : 0);
+	} while (csock == -1 && errno == EINTR);
+	if (csock == -1) {
+		if (lsock == local_sock && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		die(SRC_ACCEPT);
+	}
+	assert(addrlen <= sizeof(struct sockaddr_in));
+	struct client cl = {.sock = csock, .addr = cli_addr.sin_addr, .local = lsock == local_sock};
+	if (!conn_admit(&cl)) return;
+
+#ifdef USE_AESD_CHAR_DEVICE
+	if (ofd == -1) of_open(die);
+#endif
+
+	if (mode == MODE_EPOLL) {
+		// give connection to the next worker
+		struct conn* c = conn_get(&workers[*next_worker], die);
+		conn_init(c, cl, true);
+		epoll_add(&workers[*next_worker], c, die);
+		*next_worker += nlisteners;
+		if (*next_worker >= nworkers) *next_worker = idx;
+		return;
+	}
+
+	// queue connection for the pool
+	workq_push(cl);
+}
+
+// accept connections on a listener (and the local one) and hand them to the workers (exited via
+// interrupt or cancellation, or returns once a new server is taking over)
+static void accept_loop (int idx, cleanup_fn die) {
+	struct acceptor* a = &acceptors[idx];
+	int next_worker = idx; // epoll workers idx, idx + nlisteners, ... belong to this acceptor
+	if (drain_fd == -1 && local_sock == -1) { // nothing else to wait for
+		while (1)
+			accept_one(idx, a->sock, &next_worker, die);
+	}
+
+	// poll ignores the descriptors that are -1
+	struct pollfd pfds[3] = {{.fd = drain_fd, .events = POLLIN}, {.fd = a->sock, .events = POLLIN},
+		{.fd = local_sock, .events = POLLIN}};
+	while (1) {
+		int n = poll(pfds, 3, -1);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			die(SRC_ACCEPT);
+		}
+		if (pfds[0].revents) break; // a new server is taking over
+		if (pfds[1].revents) accept_one(idx, a->sock, &next_worker, die);
+		if (pfds[2].revents) accept_one(idx, local_sock, &next_worker, die);
+	}
+	atomic_fetch_sub(&accepting, 1);
+}
+
+static void* acceptor (void* param_v) {
+	accept_loop((struct acceptor*) param_v - acceptors, cleanup_thr);
+	return NULL;
+}
+
+// the i-th core this process is allowed on, wrapping around (-1 if it can't be told)
+static int cpu_nth (int i) {
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1 || CPU_COUNT(&cpus) == 0) return -1;
+	i %= CPU_COUNT(&cpus);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, &cpus) && i-- == 0) return cpu;
+	return -1;
+}
+
+//-----handoff-----
+// a restarted server connects to the handoff socket; this one stops accepting, lets its connections
+// finish, and passes the listeners over as the very last thing before it exits (so the output is
+// never appended to by both); connections arriving in the meantime wait in the listen backlog
+
+static void nap_ms (long ms) {
+	struct timespec ts = {.tv_sec = ms/1000, .tv_nsec = (ms%1000)*1000000};
+	nanosleep(&ts, NULL);
+}
+
+static void* handoff_serve (void* unused) {
+	char req;
+	while (1) {
+		handoff_peer = accept4(handoff_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (handoff_peer == -1) continue;
+		if (read(handoff_peer, &req, 1) == 1) break;
+		close(handoff_peer);
+	}
+
+	// stop taking connections, and let keep-alive ones go after their current request
+	syslog(LOG_INFO, "new server is taking over, draining %d connections", (int) nconns);
+	atomic_store(&draining, true);
+	uint64_t one = 1;
+	if (write(drain_fd, &one, sizeof(one)) == -1) cleanup_thr(SRC_HANDOFF);
+#ifndef USE_AESD_CHAR_DEVICE
+	follow_wake(true); // followers give up, and the ring stops accepting
+#endif
+	while (atomic_load(&accepting))
+		nap_ms(1);
+
+	// hurry along idle ones (whatever they already sent is still read and answered)
+	uint64_t start = now_ns();
+	while (atomic_load(&nconns) && now_ns() - start < DRAIN_GRACE_MS*1000000UL)
+		nap_ms(1);
+	for (int fd = 0; atomic_load(&nconns) && fd < conn_socks_max; ++fd)
+		if (atomic_load_explicit(&conn_socks[fd], memory_order_relaxed)) shutdown(fd, SHUT_RD);
+	while (atomic_load(&nconns) && now_ns() - start < DRAIN_SECS*1000000000UL)
+		nap_ms(1);
+	if (nconns) syslog(LOG_WARNING, "closing %d connections still open after %ds", (int) nconns, DRAIN_SECS);
+	errno = 0;
+	cleanup_thr(SRC_HANDED);
+}
+
+// take the listeners over from a running server, if there is one (before touching the output,
+// which is the old server's until it has handed off)
+static void handoff_take (void) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(handoff_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		cleanup(SRC_HANDOFF);
+	}
+	strcpy(addr.sun_path, handoff_path);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) cleanup(SRC_HANDOFF);
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		if (errno != ENOENT && errno != ECONNREFUSED) cleanup(SRC_HANDOFF);
+		close(sock); // nobody to take over from
+		return;
+	}
+	syslog(LOG_INFO, "taking over from the running server");
+
+	union {
+		char buf[CMSG_SPACE(HANDOFF_MAX_FDS*sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	char tag = 'H';
+	struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf)};
+	ssize_t n = write(sock, &tag, 1);
+	if (n == 1) {
+		do {
+			n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		} while (n == -1 && errno == EINTR);
+	}
+	if (n == -1) cleanup(SRC_HANDOFF);
+	close(sock);
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	if (n == 0 || !cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) { // it went away first
+		syslog(LOG_WARNING, "running server exited without handing off, starting afresh");
+		return;
+	}
+
+	int nfds = (cm->cmsg_len - CMSG_LEN(0))/sizeof(int);
+	acceptors = calloc(nfds, sizeof(struct acceptor));
+	if (!acceptors) cleanup(SRC_MALLOC);
+	nlisteners = 0;
+	for (int i = 0; i < nfds; ++i) { // CMSG_DATA needn't be aligned
+		int fd;
+		memcpy(&fd, CMSG_DATA(cm) + i*sizeof(int), sizeof(int));
+		struct sockaddr_storage sa;
+		socklen_t salen = sizeof(sa);
+		if (getsockname(fd, (struct sockaddr*) &sa, &salen) == -1) cleanup(SRC_HANDOFF);
+		if (sa.ss_family != AF_UNIX) acceptors[nlisteners++].sock = fd;
+		else if (local_path && local_sock == -1) local_sock = fd;
+		else close(fd); // not wanted any more
+	}
+}
+
+#ifdef USE_IO_URING
+//-----io_uring engine-----
+// a single thread drives multishot accept, receives into a provided buffer ring, and replies
+// sent straight from the mapping (linked to the close when they're a connection's last); a timer
+// looks for sends stalled on slow readers
+
+#define URING_ENTRIES 4096
+#define URING_BUFS 1024 // provided receive buffers (power of 2)
+#define URING_BUFSZ 4096
+#define URING_BGID 0
+
+// operation a completion belongs to (low bits of user_data, conns are aligned)
+enum uring_op {UOP_ACCEPT, UOP_RECV, UOP_SEND, UOP_CLOSE, UOP_FSYNC, UOP_TIMER, UOP_WAKE, UOP_CANCEL};
+#define UOP_MASK 7UL
+
+// hand a receive buffer (back) to the kernel
+static void uring_buf_add (unsigned short bid) {
+	struct io_uring_buf* b = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+	b->addr = (uintptr_t) &ring.bufs[(size_t) bid*URING_BUFSZ];
+	b->len = URING_BUFSZ;
+	b->bid = bid;
+	++ring.br_tail;
+	atomic_store_explicit((_Atomic unsigned short*) &ring.br->tail, ring.br_tail, memory_order_release);
+}
+
+// set up the ring and its provided buffers
+static void uring_init (void) {
+	struct io_uring_params p = {0};
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd == -1) cleanup(SRC_URING);
+
+	// map submission and completion queues
+	size_t sq_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	size_t cq_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) sq_sz = cq_sz = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+	char* sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) cleanup(SRC_URING);
+	char* cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) cleanup(SRC_URING);
+	}
+	ring.sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) cleanup(SRC_URING);
+	ring.sq_head = (unsigned*) (sq + p.sq_off.head);
+	ring.sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*) (sq + p.sq_off.array);
+	ring.sq_entries = p.sq_entries;
+	ring.cq_head = (unsigned*) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	ring.sqe_tail = *ring.sq_tail;
+
+	// register provided receive buffers
+	ring.br = mmap(NULL, URING_BUFS*sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring.br == MAP_FAILED) cleanup(SRC_URING);
+	ring.bufs = malloc((size_t) URING_BUFS*URING_BUFSZ);
+	if (!ring.bufs) cleanup(SRC_MALLOC);
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t) ring.br,
+		.ring_entries = URING_BUFS,
+		.bgid = URING_BGID
+	};
+	int s = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (s == -1) cleanup(SRC_URING);
+	for (unsigned short i = 0; i < URING_BUFS; ++i)
+		uring_buf_add(i);
+	uring_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (uring_wakefd == -1) cleanup(SRC_URING);
+}
+
+// submit queued entries and optionally wait for a completion
+static void uring_submit (unsigned wait) {
+	atomic_store_explicit((_Atomic unsigned*) ring.sq_tail, ring.sqe_tail, memory_order_release);
+	unsigned pending = ring.sqe_tail - atomic_load_explicit((_Atomic unsigned*) ring.sq_head, memory_order_acquire);
+	int s = syscall(__NR_io_uring_enter, ring.fd, pending, wait, (wait) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (s == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) cleanup(SRC_URING);
+}
+
+// get a blank submission entry
+static struct io_uring_sqe* uring_sqe (int op, int fd, uintptr_t data) {
+	while (ring.sqe_tail - atomic_load_explicit((_Atomic unsigned*) ring.sq_head, memory_order_acquire) >= ring.sq_entries)
+		uring_submit(0); // full, make room
+	unsigned idx = ring.sqe_tail++ & *ring.sq_mask;
+	struct io_uring_sqe* sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = data;
+	ring.sq_array[idx] = idx;
+	return sqe;
+}
+
+// accepts carry their listener where other operations have their connection
+static void uring_accept (int lsock) {
+	struct io_uring_sqe* sqe = uring_sqe(IORING_OP_ACCEPT, lsock, (uint64_t) lsock << 3 | UOP_ACCEPT);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void uring_recv (struct conn* c) {
+	struct io_uring_sqe* sqe = uring_sqe(IORING_OP_RECV, c->sock, (uintptr_t) c | UOP_RECV);
+	sqe->len = URING_BUFSZ;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	++c->inflight;
+	if (idle_timeout) conn_watch(&uring_receiving, c);
+}
+
+static void uring_close (struct conn* c) {
+	conn_forget(c);
+	uring_sqe(IORING_OP_CLOSE, c->sock, (uintptr_t) c | UOP_CLOSE);
+	++c->inflight;
+}
+
+static void uring_send (struct conn* c) {
+	size_t len;
+	if (!conn_span(c, &len)) {
+		c->state = CS_DONE;
+		uring_close(c);
+		return;
+	}
+	struct io_uring_sqe* sqe = uring_sqe(IORING_OP_SEND, c->sock, (uintptr_t) c | UOP_SEND);
+	sqe->addr = (uintptr_t) c->seg->mem + (c->reply_off - c->seg->base); // its reference (and of_pinned) keep this valid
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	++c->inflight;
+	if (send_timeout) conn_watch(&uring_sending, c);
+	if (!keepalive && reply_policy == REPLY_BATCH && !c->follow && c->reply_off + len == c->reply_sz) { // nothing follows this reply
+		sqe->flags |= IOSQE_IO_LINK;
+		c->state = CS_DONE;
+		uring_close(c);
+	}
+}
+
+// flush everything committed so far (group commit, one flush in flight at a time)
+static void uring_fsync (void) {
+	uring_sync_end = atomic_load(&of_sz);
+	uring_sync_seg = seg_get_end(&seg_last); // sealed segments were flushed when they filled up
+	struct io_uring_sqe* sqe = uring_sqe(IORING_OP_FSYNC, uring_sync_seg->fd, UOP_FSYNC);
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	uring_syncing = true;
+}
+
+// wake up for the next stall check
+static void uring_timer (void) {
+	static struct __kernel_timespec ts = {.tv_nsec = SEND_SWEEP_NS};
+	struct io_uring_sqe* sqe = uring_sqe(IORING_OP_TIMEOUT, -1, UOP_TIMER);
+	sqe->addr = (uintptr_t) &ts;
+	sqe->len = 1;
+}
+
+// drop clients whose send has stalled, or that went idle: shutting the socket fails the send (or
+// ends the receive), and the connection closes the usual way when it completes
+static void uring_sweep (void) {
+	uint64_t now = now_ns();
+	for (int idle = 0; idle < 2; ++idle) {
+		for (struct conn *c = (idle) ? uring_receiving : uring_sending, *next; c; c = next) {
+			next = c->wnext;
+			if (!conn_stalled(c, now, (idle) ? idle_timeout : send_timeout)) continue;
+			conn_unwatch(c);
+			if (idle) conn_idle(c);
+			else conn_slow(c);
+			shutdown(c->sock, SHUT_RDWR);
+		}
+	}
+}
+
+// hold a reply until a flush covers its records
+static void uring_park (struct conn* c) {
+	if (atomic_load(&of_durable) >= c->stored_sz) {
+		c->state = CS_SEND;
+		uring_send(c);
+		return;
+	}
+	c->parked = true;
+	c->next = uring_parked;
+	uring_parked = c;
+	if (!uring_syncing) uring_fsync();
+}
+
+static void uring_next (struct conn* c);
+
+// a flush finished: release everyone it covers, and start another for the rest
+static void uring_synced (int res) {
+	uring_syncing = false;
+	seg_put(uring_sync_seg);
+	if (res < 0) {
+		errno = -res;
+		cleanup(SRC_SYNC);
+	}
+	atomic_store(&of_durable, uring_sync_end);
+	stat_add(ST_FLUSHES, 1);
+	struct conn* p = uring_parked;
+	uring_parked = NULL;
+	while (p) {
+		struct conn* next = p->next;
+		p->parked = false;
+		uring_next(p);
+		p = next;
+	}
+}
+
+// a follower has nothing left to send: wait for the next commit (arming the poke before looking again)
+static void uring_follow (struct conn* c) {
+	atomic_store(&uring_armed, true);
+	if (conn_follow(c)) uring_next(c);
+	else conn_watch(&uring_following, c);
+}
+
+// queue whatever a connection needs next, once its last operation has completed
+static void uring_next (struct conn* c) {
+	if (c->inflight) return;
+	if (c->sock == -1) { // closed, keep for the next connection
+		conn_closed(c);
+		c->next = uring_idle;
+		uring_idle = c;
+		return;
+	}
+	switch (c->state) {
+		case CS_RECV: uring_recv(c); break;
+		case CS_SYNC: uring_park(c); break;
+		case CS_SEND: uring_send(c); break;
+		case CS_FOLLOW: uring_follow(c); break;
+		case CS_DONE: uring_close(c); break;
+	}
+}
+
+// output was committed with followers waiting, or a handoff began
+static void uring_woken (void) {
+	uint64_t v;
+	if (read(uring_wakefd, &v, sizeof(v)) == -1 && errno != EAGAIN) cleanup(SRC_URING);
+	if (atomic_load(&draining) && !uring_draining) { // a new server is taking over, stop accepting
+		uring_draining = true;
+		uring_sqe(IORING_OP_ASYNC_CANCEL, -1, UOP_CANCEL)->addr = (uint64_t) acceptors[0].sock << 3 | UOP_ACCEPT;
+		if (local_sock != -1)
+			uring_sqe(IORING_OP_ASYNC_CANCEL, -1, UOP_CANCEL)->addr = (uint64_t) local_sock << 3 | UOP_ACCEPT;
+	}
+	for (struct conn *c = uring_following, *next; c; c = next) {
+		next = c->wnext;
+		conn_unwatch(c);
+		uring_next(c);
+	}
+	uring_sqe(IORING_OP_POLL_ADD, uring_wakefd, UOP_WAKE)->poll32_events = POLLIN;
+}
+
+// new connection from multishot accept
+static void uring_accepted (int sock, bool local) {
+	struct sockaddr_in addr = {0};
+	socklen_t addrlen = sizeof(struct sockaddr_in);
+	if (!local) getpeername(sock, (struct sockaddr*) &addr, &addrlen); // multishot accept can't return it
+	struct client cl = {.sock = sock, .addr = addr.sin_addr, .local = local};
+	if (!conn_admit(&cl)) return;
+	struct conn* c = uring_idle;
+	if (c) uring_idle = c->next;
+	else {
+		c = calloc(1, sizeof(struct conn));
+		if (!c) cleanup(SRC_MALLOC);
+		atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+	}
+	conn_init(c, cl, true);
+	uring_recv(c);
+}
+
+static void uring_complete (struct io_uring_cqe* cqe) {
+	struct conn* c = (struct conn*) (uintptr_t) (cqe->user_data & ~UOP_MASK);
+	int res = cqe->res;
+	switch (cqe->user_data & UOP_MASK) {
+		case UOP_ACCEPT:
+			if (res >= 0) uring_accepted(res, (int) (cqe->user_data >> 3) == local_sock);
+			else if (res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+				errno = -res;
+				cleanup(SRC_ACCEPT);
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE)) { // multishot ended, re-arm (unless handing off)
+				if (atomic_load(&draining)) atomic_fetch_sub(&accepting, 1);
+				else uring_accept(cqe->user_data >> 3);
+			}
+			return;
+
+		case UOP_WAKE:
+			uring_woken();
+			return;
+
+		case UOP_CANCEL:
+			return;
+
+		case UOP_FSYNC:
+			uring_synced(res);
+			return;
+
+		case UOP_TIMER:
+			uring_sweep();
+			uring_timer();
+			return;
+
+		case UOP_RECV:
+			--c->inflight;
+			conn_unwatch(c);
+			if (res > 0) {
+				unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				if (!conn_reserve(c, (conn_want(c) > (size_t) res) ? conn_want(c) : (size_t) res)) {
+					uring_buf_add(bid);
+					break;
+				}
+				memcpy(&c->packet[c->packet_sz], &ring.bufs[(size_t) bid*URING_BUFSZ], res);
+				uring_buf_add(bid);
+				stat_add(ST_BYTES_COPIED, res);
+				conn_received(c, res);
+			} else if (res != -ENOBUFS) { // hung up or failed (out of buffers just retries)
+				if (res == 0 && c->packet_sz > c->rec_start)
+					logmsg(LOG_WARNING, LM_WARN, "Connection from %s closed before end of packet", c->cip);
+				c->state = CS_DONE;
+			}
+			break;
+
+		case UOP_SEND:
+			--c->inflight;
+			conn_unwatch(c);
+			if (res < 0) c->state = CS_DONE;
+			else {
+				c->reply_off += res;
+				stat_add(ST_BYTES_OUT, res);
+				if (c->reply_off == c->reply_sz) {
+					if (c->state == CS_SEND) conn_replied(c);
+					else conn_answered(c); // close linked to the reply
+				}
+			}
+			break;
+
+		case UOP_CLOSE:
+			--c->inflight;
+			if (res != -ECANCELED) c->sock = -1; // cancelled by a failed send, close again
+			break;
+	}
+	uring_next(c);
+}
+
+// io_uring server loop (exited via interrupt)
+__attribute__((noreturn))
+static void uring_serve (void) {
+	uring_accept(acceptors[0].sock);
+	if (local_sock != -1) uring_accept(local_sock);
+	if (send_timeout || idle_timeout) uring_timer();
+	uring_sqe(IORING_OP_POLL_ADD, uring_wakefd, UOP_WAKE)->poll32_events = POLLIN;
+	while (1) {
+		uring_submit(1);
+		unsigned head = *ring.cq_head;
+		unsigned tail = atomic_load_explicit((_Atomic unsigned*) ring.cq_tail, memory_order_acquire);
+		for (; head != tail; ++head) {
+			uring_complete(&ring.cqes[head & *ring.cq_mask]);
+			atomic_store_explicit((_Atomic unsigned*) ring.cq_head, head + 1, memory_order_release);
+		}
+	}
+}
+#endif // USE_IO_URING
+
+#ifndef USE_AESD_CHAR_DEVICE
+// periodic time logger thread (appends a timestamp record on every timerfd tick)
+static void* wrtime (void* unused) {
+	// the date and zone only change at midnight (or a DST switch), so they're formatted once a day
+	char timestr[MAX_TIMELEN];
+	char zone[16];
+	size_t datelen = 0, zonelen = 0;
+	int day = -1, year = -1;
+	long gmtoff = 0;
+
+	while (1) {
+		uint64_t ticks;
+		ssize_t n = read(wrtime_fd, &ticks, sizeof(ticks)); // missed ticks collapse into one timestamp
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			cleanup_thr(SRC_TIMER);
+		}
+
+		time_t t = time(NULL);
+		struct tm tm;
+		localtime_r(&t, &tm);
+		if (tm.tm_yday != day || tm.tm_year != year || tm.tm_gmtoff != gmtoff) {
+			datelen = strftime(timestr, MAX_TIMELEN, "timestamp:%a, %d %b %Y ", &tm);
+			zonelen = strftime(zone, sizeof(zone), " %z\n", &tm);
+			if (datelen == 0 || zonelen == 0) cleanup_thr(SRC_STRFTIME);
+			day = tm.tm_yday;
+			year = tm.tm_year;
+			gmtoff = tm.tm_gmtoff;
+		}
+		size_t len = datelen + sprintf(timestr + datelen, "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+		memcpy(timestr + len, zone, zonelen);
+		of_append(&(struct iovec) {.iov_base = timestr, .iov_len = len + zonelen}, 1, cleanup_thr);
+		if (seg_size && keep_secs) of_retain(cleanup_thr);
+	}
+	return NULL;
+}
+#endif // USE_AESD_CHAR_DEVICE
+
+// parse a size argument with an optional K/M/G suffix
+static bool parse_size (const char* arg, size_t* sz) {
+	char* end;
+	errno = 0;
+	unsigned long long v = strtoull(arg, &end, 0);
+	if (errno || end == arg) return false;
+	switch (*end) {
+		case 'G': case 'g': v <<= 10; // fallthrough
+		case 'M': case 'm': v <<= 10; // fallthrough
+		case 'K': case 'k': v <<= 10; ++end; // fallthrough
+		case '\0': break;
+		default: return false;
+	}
+	if (*end) return false;
+	*sz = (size_t) v;
+	return true;
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+// end of the framed record at p (NULL if it isn't one that's complete before end)
+static char* frame_end (char* p, char* end) {
+	if (*p != FRAME_MARK || end - p < 1 + FRAME_HDR + 1) return NULL;
+	uint32_t len;
+	memcpy(&len, p + 1, FRAME_HDR);
+	size_t sz = 1 + FRAME_HDR + (size_t) ntohl(len) + 1;
+	return (sz <= (size_t) (end - p) && p[sz - 1] == '\n') ? p + sz : NULL;
+}
+
+// end of the stored record at p (NULL if it isn't complete before end): a framed record says how
+// long it is (one that doesn't end where it says is taken as text), anything else runs to a newline
+static char* rec_end (char* p, char* end) {
+	char* f = frame_end(p, end);
+	if (f) return f;
+	char* nl = memchr(p, '\n', end - p);
+	return (nl) ? nl + 1 : NULL;
+}
+
+// record j of the index file as a previous run left it
+static uint64_t idx_read (size_t j) {
+	uint64_t e;
+	return (pread(idx_fd, &e, sizeof(e), IDX_HDR + j*sizeof(e)) == sizeof(e)) ? e : 0;
+}
+
+// how many of the previous run's first n records end at or before output offset off
+// (ones punched out read as 0)
+static size_t idx_find (size_t n, size_t off) {
+	size_t lo = 0;
+	while (lo < n) {
+		size_t mid = lo + (n - lo)/2;
+		if (idx_read(mid) <= off) lo = mid + 1;
+		else n = mid;
+	}
+	return lo;
+}
+
+// open the record index; whatever a previous run left in it is only trusted as far as the
+// output it points into checks out
+static void idx_open (void) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), INDEX_NAME, outpath);
+	idx_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (idx_fd == -1) cleanup(SRC_INDEX);
+	struct stat st;
+	if (fstat(idx_fd, &st) == -1) cleanup(SRC_FSTAT);
+	idx_fsz = (size_t) st.st_size;
+	if (idx_fsz < IDX_HDR) {
+		if (ftruncate(idx_fd, IDX_HDR) == -1) cleanup(SRC_INDEX);
+		idx_fsz = IDX_HDR;
+	}
+	idx_hdr = mmap(NULL, IDX_HDR, PROT_READ | PROT_WRITE, MAP_SHARED, idx_fd, 0);
+	if (idx_hdr == MAP_FAILED) cleanup(SRC_INDEX);
+	if (memcmp(idx_hdr->magic, IDX_MAGIC, sizeof(idx_hdr->magic)) == 0 && idx_hdr->n <= (idx_fsz - IDX_HDR)/sizeof(uint64_t))
+		idx_old_n = idx_hdr->n;
+}
+
+// length of the output left in the segment a previous run was appending to (size bytes on file):
+// the index says how far it was committed (walked back past records that never reached the disk),
+// then whole records copied in past that are kept too, up to the zero padding (or a torn record)
+static size_t of_recover (struct segment* sg, size_t size) {
+	size_t from = sg->base;
+	for (idx_old_n = idx_find(idx_old_n, sg->base + size); idx_old_n; --idx_old_n) {
+		size_t e = idx_read(idx_old_n - 1);
+		if (e <= sg->base) break; // the segments before it are whole
+		if (sg->mem[e - 1 - sg->base] == '\n') {
+			from = e;
+			break;
+		}
+	}
+	char *p = sg->mem + (from - sg->base), *end = sg->mem + size, *next;
+	for (; p < end && (next = (*p != FRAME_MARK) ? rec_end(p, end) : frame_end(p, end)); p = next);
+	return p - sg->mem;
+}
+
+// pick up the segments a previous run left behind, and start a new active segment after them
+static void of_load (void) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), MANIFEST_NAME, outpath);
+	FILE* f = fopen(path, "re");
+	unsigned long seq, next = 0;
+	size_t base, end = 0;
+	char used_s[32], sealed_s[32];
+	while (f && fscanf(f, "%lu %zu %31s %31s", &seq, &base, used_s, sealed_s) == 4) {
+		struct segment* sg = calloc(1, sizeof(struct segment));
+		if (!sg) cleanup(SRC_MALLOC);
+		snprintf(path, sizeof(path), SEG_NAME, outpath, seq);
+		sg->fd = open(path, O_RDWR | O_CLOEXEC);
+		if (sg->fd == -1) cleanup(SRC_OPEN);
+		struct stat st;
+		if (fstat(sg->fd, &st) == -1) cleanup(SRC_FSTAT);
+		size_t used = (size_t) st.st_size; // the active one ends where its file does
+		if (strcmp(used_s, "-") != 0 && strtoul(used_s, NULL, 10) < used) used = strtoul(used_s, NULL, 10);
+		if (used) {
+			sg->mem = mmap(NULL, used, PROT_READ, MAP_SHARED, sg->fd, 0);
+			if (sg->mem == MAP_FAILED) cleanup(SRC_MMAP);
+		}
+		sg->vsz = used;
+		sg->base = base;
+		if (strcmp(used_s, "-") == 0) { // it was still preallocated, so drop the unwritten rest
+			used = of_recover(sg, used);
+			if (ftruncate(sg->fd, used) == -1) cleanup(SRC_FTRUNCATE);
+		}
+		sg->seq = seq;
+		sg->memsz = sg->cap = used;
+		sg->tail = SEG_SEALED;
+		sg->end = end = base + used;
+		sg->sealed = (strcmp(sealed_s, "-") != 0) ? atol(sealed_s) : time(NULL);
+		sg->refs = 1;
+		segs[seq % SEG_SLOTS] = sg;
+		if (!next) seg_first = seq;
+		seg_last = seq;
+		next = seq + 1;
+	}
+	if (f) fclose(f);
+
+	of_sz = end;
+	of_first = (next) ? segs[seg_first % SEG_SLOTS]->base : end;
+	seg_trim(next, cleanup);
+	of_active = segs[next % SEG_SLOTS] = seg_open(next, end, seg_size, cleanup);
+	seg_last = next;
+	of_manifest(cleanup);
+	seg_trim(next, cleanup);
+}
+
+// index the records already in the output (before anyone appends): a previous run's index is
+// taken up from the oldest retained record, and only the output past its last record is scanned
+static void idx_build (void) {
+	idx_0 = of_first;
+	size_t n = idx_old_n, skip = idx_find(n, of_first);
+	if (!n || ((skip) ? idx_read(skip - 1) : idx_hdr->base) != of_first) { // not this output's, start over
+		n = skip = 0;
+		memcpy(idx_hdr->magic, IDX_MAGIC, sizeof(idx_hdr->magic));
+		idx_hdr->base = of_first;
+	}
+	atomic_store(&idx_hdr->n, n); // may have been walked back
+	idx_skip = skip;
+	idx_moff = (IDX_HDR + skip*sizeof(uint64_t))/PAGE_SIZE*PAGE_SIZE;
+	// reserved in proportion to the output's (it moves like the output's once that runs out)
+	idx_vsz = of_vsz/IDX_VSZ_RATIO;
+	if (idx_vsz < IDX_VSZ_MIN) idx_vsz = IDX_VSZ_MIN;
+	if (idx_vsz < 2*(idx_fsz - idx_moff)) idx_vsz = 2*(idx_fsz - idx_moff);
+	idx_vsz = ((idx_vsz - 1)/PAGE_SIZE + 1)*PAGE_SIZE;
+	idx_mem = mmap(NULL, idx_vsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, idx_fd, idx_moff);
+	if (idx_mem == MAP_FAILED) {
+		syslog(LOG_ERR, "can't reserve %zu bytes of address space for the record index, try a smaller -V", idx_vsz);
+		cleanup(SRC_INDEX);
+	}
+	idx_ents = (uint64_t*) (idx_mem + IDX_HDR + skip*sizeof(uint64_t) - idx_moff);
+	idx_lo = (idx_moff > IDX_HDR) ? idx_moff : (IDX_HDR + PAGE_SIZE - 1)/PAGE_SIZE*PAGE_SIZE; // never the header
+	idx_n = n - skip;
+
+	size_t from = (idx_n) ? idx_ents[idx_n - 1] : of_first;
+	for (unsigned long seq = seg_first; seq <= seg_last; ++seq) {
+		struct segment* sg = segs[seq % SEG_SLOTS];
+		size_t lo = (from > sg->base) ? from : sg->base, hi = (sg->end < of_sz) ? sg->end : of_sz;
+		char* end = sg->mem + (hi - sg->base);
+		for (char *p = sg->mem + (lo - sg->base), *next; p < end && (next = rec_end(p, end)); p = next)
+			idx_add(sg->base + (next - sg->mem), cleanup);
+	}
+	syslog(LOG_INFO, "output holds %zu records, %zu bytes scanned for them", (size_t) idx_n, of_sz - from);
+}
+
+// start the background flusher
+static void sync_start (sigset_t* sigs) {
+	pthread_sigmask(SIG_BLOCK, sigs, NULL); // this thread handles all signals
+	int s = pthread_create(&sync_tid, NULL, syncer, NULL);
+	pthread_sigmask(SIG_UNBLOCK, sigs, NULL);
+	if (s != 0) cleanup_errno(SRC_PTHCR, s);
+	sync_running = true;
+}
+#endif
+
+// write a pid to the -p file
+static bool pid_write (pid_t pid) {
+	FILE* f = fopen(pid_path, "we");
+	if (!f) return false;
+	bool ok = fprintf(f, "%d\n", (int) pid) > 0;
+	return fclose(f) == 0 && ok;
+}
+
+// listen on a unix socket (replacing one left over from a previous run)
+static void unix_listen (int* sock, const char* path, int backlog, cleanup_src src) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		cleanup(src);
+	}
+	strcpy(addr.sun_path, path);
+	*sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (*sock == -1) cleanup(src);
+	unlink(path);
+	if (bind(*sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) cleanup(src);
+	if (listen(*sock, backlog) == -1) cleanup(src);
+}
+
+// log buffer allocation counters (SIGUSR1 handler)
+static void logstats (int sig) {
+	assert(sig == SIGUSR1);
+	syslog(LOG_INFO, "buffer allocations %lu, frees %lu, trims %lu", nallocs, nfrees, ntrims);
+}
+
+int main (int argc, char** argv) {
+	// open syslog
+	openlog(NULL, LOG_PERROR, LOG_USER);
+
+	// parse args: -d (daemonise), -m thread|epoll|uring (server model), -t N (pool or epoll threads),
+	// -M (reply by copying from the mapping instead of sendfile), -k (keep-alive),
+	// -r record|batch|none (reply after each record, after each batch of records read together, or never),
+	// -V size (address space to reserve for the output mapping, and a 16th of that for the record index), -g size (output file growth step, 0 to double),
+	// -H (use huge pages for the output mapping), -b size (free connection buffers above this size on close),
+	// -L N (SO_REUSEPORT listeners, each with an acceptor pinned to a core), -B N (listen backlog),
+	// -T secs (timestamp interval, 0 to disable), -l prio (connection log level, 0-7),
+	// -R N (connection messages of each type per thread per second, 0 for no limit),
+	// -S path (serve metrics on this unix socket), -D none|async|group (durability: none,
+	// background writeback every -W ms, or replies wait for a shared fdatasync), -s size (split the
+	// output into segment files of this size), -K size, -A secs (retire the oldest segments beyond this
+	// much output, or filled longer ago than this), -X dir (archive retired segments here instead of deleting them),
+	// -O secs (drop a client whose reply makes no progress for this long, 0 to wait forever),
+	// -Q size (most reply data the kernel queues for each connection),
+	// -U path (hand the listeners over to a restarted server through this unix socket, and take them over
+	// from a running one), -u path (also take clients on a unix stream socket at this path),
+	// -C N (shed connections beyond this many open), -N N (shed connections from an address beyond this
+	// many a second), -P size (drop a client sending a longer record; binary frames are limited to 64M without it), -i secs (drop a client that sends
+	// nothing for this long while a request is awaited), -p path (write the server's pid to this file, the
+	// daemon's with -d, before the command returns)
+	bool daemon = false;
+	int nthreads = 0;
+	int backlog = DEFAULT_BACKLOG;
+#ifndef USE_AESD_CHAR_DEVICE
+	of_vsz = DEFAULT_VSZ;
+#endif
+	int opt;
+	while ((opt = getopt(argc, argv, "dm:t:Mkr:V:g:Hb:L:B:T:l:R:S:D:W:s:K:A:X:O:Q:U:u:C:N:P:i:p:")) != -1) {
+		switch (opt) {
+			case 'd':
+				daemon = true;
+				break;
+			case 'm':
+				if (strcmp(optarg, "thread") == 0) mode = MODE_THREAD;
+				else if (strcmp(optarg, "epoll") == 0) mode = MODE_EPOLL;
+#ifdef USE_IO_URING
+				else if (strcmp(optarg, "uring") == 0) mode = MODE_URING;
+#endif
+				else opt = '?';
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				if (nthreads <= 0) opt = '?';
+				break;
+			case 'M':
+#ifndef USE_AESD_CHAR_DEVICE
+				use_sendfile = false;
+#endif
+				break;
+			case 'k':
+				keepalive = true;
+				break;
+			case 'r':
+				if (strcmp(optarg, "record") == 0) reply_policy = REPLY_RECORD;
+				else if (strcmp(optarg, "batch") == 0) reply_policy = REPLY_BATCH;
+				else if (strcmp(optarg, "none") == 0) reply_policy = REPLY_NONE;
+				else opt = '?';
+				break;
+#ifndef USE_AESD_CHAR_DEVICE
+			case 'V':
+				if (!parse_size(optarg, &of_vsz) || of_vsz == 0) opt = '?';
+				break;
+			case 'g':
+				if (!parse_size(optarg, &grow_chunk)) opt = '?';
+				break;
+			case 'H':
+				use_hugepages = true;
+				break;
+			case 'T':
+				if (atoi(optarg) < 0) opt = '?';
+				else wrtime_period = atoi(optarg);
+				break;
+			case 'D':
+				if (strcmp(optarg, "none") == 0) durability = DUR_NONE;
+				else if (strcmp(optarg, "async") == 0) durability = DUR_ASYNC;
+				else if (strcmp(optarg, "group") == 0) durability = DUR_GROUP;
+				else opt = '?';
+				break;
+			case 'W':
+				if (atoi(optarg) <= 0) opt = '?';
+				else writeback_ms = atoi(optarg);
+				break;
+			case 's':
+				if (!parse_size(optarg, &seg_size) || (seg_size && seg_size < MIN_SEG_SIZE)) opt = '?';
+				break;
+			case 'K':
+				if (!parse_size(optarg, &keep_bytes)) opt = '?';
+				break;
+			case 'A':
+				if (atoi(optarg) < 0) opt = '?';
+				else keep_secs = atoi(optarg);
+				break;
+			case 'X':
+				archive_dir = optarg;
+				break;
+#endif
+			case 'b':
+				if (!parse_size(optarg, &buf_trim)) opt = '?';
+				break;
+			case 'L':
+				nlisteners = atoi(optarg);
+				if (nlisteners <= 0) opt = '?';
+				break;
+			case 'B':
+				backlog = atoi(optarg);
+				if (backlog <= 0) opt = '?';
+				break;
+			case 'l':
+				log_level = atoi(optarg);
+				if (log_level < LOG_EMERG || log_level > LOG_DEBUG) opt = '?';
+				break;
+			case 'R':
+				if (atoi(optarg) < 0) opt = '?';
+				else log_rate = atoi(optarg);
+				break;
+			case 'S':
+				stats_path = optarg;
+				break;
+			case 'O':
+				if (atoi(optarg) < 0) opt = '?';
+				else send_timeout = atoi(optarg);
+				break;
+			case 'Q':
+				if (!parse_size(optarg, &conn_sndbuf) || conn_sndbuf > INT_MAX/2) opt = '?';
+				break;
+			case 'U':
+				handoff_path = optarg;
+				break;
+			case 'p':
+				pid_path = optarg;
+				break;
+			case 'u':
+				local_path = optarg;
+				break;
+			case 'C':
+				if (atoi(optarg) < 0) opt = '?';
+				else max_conns = atoi(optarg);
+				break;
+			case 'N':
+				if (atoi(optarg) < 0 || atoi(optarg) > MAX_CONN_RATE) opt = '?';
+				else conn_rate = atoi(optarg);
+				break;
+			case 'P':
+				if (!parse_size(optarg, &max_record)) opt = '?';
+				break;
+			case 'i':
+				if (atoi(optarg) < 0) opt = '?';
+				else idle_timeout = atoi(optarg);
+				break;
+		}
+		if (opt == '?') {
+			errno = EINVAL;
+			cleanup(SRC_EINVAL);
+		}
+	}
+	if (optind < argc || (mode == MODE_URING && nlisteners > 1)) { // the ring accepts on a single listener
+		errno = EINVAL;
+		cleanup(SRC_EINVAL);
+	}
+#ifndef USE_AESD_CHAR_DEVICE
+	if (!seg_size && (keep_bytes || keep_secs || archive_dir)) { // retention works a segment at a time
+		errno = EINVAL;
+		cleanup(SRC_EINVAL);
+	}
+#endif
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads == 0) {
+		nthreads = ncpus;
+		if (mode == MODE_THREAD) nthreads *= POOL_THREADS_PER_CPU;
+	}
+	if (mode == MODE_EPOLL && nthreads < nlisteners) nthreads = nlisteners; // every acceptor needs a worker
+
+	// install signal handler
+	sigset_t fullmask;
+	sigfillset(&fullmask); // no other signals during termination
+	struct sigaction act = {
+		.sa_sigaction = sigcleanup,
+		.sa_flags = SA_SIGINFO,
+		.sa_mask = fullmask
+	};
+	int s = sigaction(SIGINT, &act, NULL);
+	if (s == -1) cleanup(SRC_SIGACTION);
+	s = sigaction(SIGTERM, &act, NULL);
+	if (s == -1) cleanup(SRC_SIGACTION);
+
+	// take over from a running server first, it has the output until then
+	if (handoff_path) handoff_take();
+	if (mode == MODE_URING && nlisteners > 1) { // the ring accepts on a single listener
+		errno = EINVAL;
+		cleanup(SRC_HANDOFF);
+	}
+
+#ifndef USE_AESD_CHAR_DEVICE
+	// open+mmap output file (or its segments)
+	PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	idx_open();
+	if (seg_size) of_load();
+	else { // one segment that grows without bound
+		struct segment* sg = calloc(1, sizeof(struct segment));
+		if (!sg) cleanup(SRC_MALLOC);
+		sg->fd = open(outpath, O_RDWR | O_CREAT | O_APPEND, 0644);
+		struct stat stat;
+		s = fstat(sg->fd, &stat);
+		if (s == -1) cleanup(SRC_FSTAT);
+		size_t size = (size_t) stat.st_size;
+		sg->memsz = (size/PAGE_SIZE + 1)*PAGE_SIZE;
+		sg->vsz = (of_vsz < 2*sg->memsz) ? 2*sg->memsz : of_vsz;
+		sg->vsz = ((sg->vsz - 1)/PAGE_SIZE + 1)*PAGE_SIZE;
+		sg->mem = mmap(NULL, sg->vsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, sg->fd, 0);
+		if (sg->mem == MAP_FAILED) {
+			syslog(LOG_ERR, "can't reserve %zu bytes of address space for the output, try a smaller -V", sg->vsz);
+			cleanup(SRC_MMAP);
+		}
+		of_advise(sg);
+		of_sz = of_recover(sg, size);
+		if (of_sz < size) syslog(LOG_INFO, "dropped %zu unwritten bytes past the output", size - of_sz);
+		sg->memsz = (of_sz/PAGE_SIZE + 1)*PAGE_SIZE;
+		s = ftruncate(sg->fd, of_sz); // zeroes any torn record the next append doesn't cover
+		if (s == 0) s = ftruncate(sg->fd, sg->memsz);
+		if (s == -1) cleanup(SRC_FTRUNCATE);
+		sg->cap = SEG_SEALED;
+		sg->tail = of_sz;
+		sg->end = SIZE_MAX;
+		sg->refs = 1;
+		of_active = segs[0] = sg;
+	}
+	idx_build();
+	of_durable = of_sz; // whatever was there before is as durable as it gets
+#endif
+
+	// create and bind sockets (the kernel spreads connections across SO_REUSEPORT listeners),
+	// unless they were handed over
+	if (!acceptors) {
+		acceptors = calloc(nlisteners, sizeof(struct acceptor));
+		if (!acceptors) cleanup(SRC_MALLOC);
+		for (int i = 0; i < nlisteners; ++i) acceptors[i].sock = -1;
+	}
+	struct sockaddr_in serv_addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(9000),
+		.sin_addr = htonl(INADDR_ANY)
+	};
+	for (int i = 0; i < nlisteners; ++i) {
+		acceptors[i].cpu = (nlisteners > 1) ? cpu_nth(i) : -1;
+		if (acceptors[i].sock != -1) continue;
+		int lsock = acceptors[i].sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (lsock == -1) cleanup(SRC_SOCKET);
+		opt = 1;
+		s = setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)); // skip waiting for address to be freed
+		if (s == -1) cleanup(SRC_SOCKET);
+		if (nlisteners > 1) {
+			s = setsockopt(lsock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int));
+			if (s == -1) cleanup(SRC_SOCKET);
+		}
+		s = bind(lsock, &serv_addr, sizeof(struct sockaddr_in));
+		if (s == -1) cleanup(SRC_BIND);
+	}
+
+	// daemonise if requested
+	if (daemon) {
+		pid_t cpid = fork();
+		if (cpid == 0) { // in daemon
+			int nullfd = open("/dev/null", O_RDWR);
+			if (nullfd == -1) cleanup(SRC_DUP);
+			int fd = dup2(nullfd, fileno(stdout));
+			if (fd == -1) cleanup(SRC_DUP);
+			fd = dup2(nullfd, fileno(stderr));
+			if (fd == -1) cleanup(SRC_DUP);
+			fd = dup2(nullfd, fileno(stdin));
+			if (fd == -1) cleanup(SRC_DUP);
+
+			syslog(LOG_INFO, "daemonised with pid %d", getpid());
+		} else {
+			printf("Daemon pid %d\n", cpid);
+			if (pid_path && !pid_write(cpid)) { // before exiting: a service manager reads it once we're gone
+				syslog(LOG_ERR, "%s %s: %s", errs[SRC_PIDFILE], pid_path, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		   	exit(0);
+		}
+	} else if (pid_path && !pid_write(getpid())) cleanup(SRC_PIDFILE);
+
+	// listen on sockets
+	for (int i = 0; i < nlisteners; ++i) {
+		s = listen(acceptors[i].sock, backlog);
+		if (s == -1) cleanup(SRC_LISTEN);
+	}
+	if (local_path && local_sock == -1) unix_listen(&local_sock, local_path, backlog, SRC_LISTEN);
+	if (local_sock != -1 && fcntl(local_sock, F_SETFL, O_NONBLOCK) == -1) cleanup(SRC_LISTEN);
+
+	// install allocation stats handler
+	act.sa_sigaction = NULL; // in case it's a union
+	act.sa_handler = logstats;
+	act.sa_flags = 0;
+	s = sigaction(SIGUSR1, &act, NULL);
+	if (s == -1) cleanup(SRC_SIGACTION);
+
+	// start logger (must be after fork)
+	pthread_sigmask(SIG_BLOCK, &fullmask, NULL); // this thread handles all signals
+	s = pthread_create(&log_tid, NULL, logger, NULL);
+	pthread_sigmask(SIG_UNBLOCK, &fullmask, NULL);
+	if (s != 0) cleanup_errno(SRC_PTHCR, s);
+	log_running = true;
+
+	// start stats endpoint (must be after fork)
+	if (stats_path) {
+		unix_listen(&stats_sock, stats_path, backlog, SRC_STATS);
+		pthread_sigmask(SIG_BLOCK, &fullmask, NULL); // this thread handles all signals
+		s = pthread_create(&stats_tid, NULL, stats_serve, NULL);
+		pthread_sigmask(SIG_UNBLOCK, &fullmask, NULL);
+		if (s != 0) cleanup_errno(SRC_PTHCR, s);
+		stats_running = true;
+	}
+
+	// wait for a restarted server to take over (must be after fork)
+	if (handoff_path) {
+		struct rlimit rl;
+		conn_socks_max = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (1 << 20)) ? (int) rl.rlim_cur : (1 << 20);
+		conn_socks = calloc(conn_socks_max, sizeof(_Atomic bool));
+		if (!conn_socks) cleanup(SRC_MALLOC);
+		accepting = (mode == MODE_URING) ? 1 + (local_sock != -1) : nlisteners;
+		drain_fd = eventfd(0, EFD_CLOEXEC);
+		if (drain_fd == -1) cleanup(SRC_HANDOFF);
+		unix_listen(&handoff_sock, handoff_path, 1, SRC_HANDOFF);
+		pthread_sigmask(SIG_BLOCK, &fullmask, NULL); // this thread handles all signals
+		s = pthread_create(&handoff_tid, NULL, handoff_serve, NULL);
+		pthread_sigmask(SIG_UNBLOCK, &fullmask, NULL);
+		if (s != 0) cleanup_errno(SRC_PTHCR, s);
+		handoff_running = true;
+	}
+
+#ifndef USE_AESD_CHAR_DEVICE
+	// start timestamp timer and its thread (must be after fork)
+	if (wrtime_period) {
+		wrtime_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (wrtime_fd == -1) cleanup(SRC_TIMER);
+		struct itimerspec its = {
+			.it_interval = {.tv_sec = wrtime_period},
+			.it_value = {.tv_sec = wrtime_period}
+		};
+		s = timerfd_settime(wrtime_fd, 0, &its, NULL);
+		if (s == -1) cleanup(SRC_TIMER);
+		pthread_sigmask(SIG_BLOCK, &fullmask, NULL); // this thread handles all signals
+		s = pthread_create(&wrtime_tid, NULL, wrtime, NULL);
+		pthread_sigmask(SIG_UNBLOCK, &fullmask, NULL);
+		if (s != 0) cleanup_errno(SRC_PTHCR, s);
+		wrtime_running = true;
+	}
+#endif
+
+	// this thread handles all signals
+	/* only in glibc >= 2.32 though :(
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setsigmask_np(&attr, &fullmask);
+	s = pthread_setattr_default_np(&attr);
+	if (s != 0) cleanup(SRC_PTHATTR);
+	pthread_attr_destroy(&attr); */
+
+#ifdef USE_IO_URING
+	// run io_uring engine on this thread (must be after fork)
+	if (mode == MODE_URING) {
+		if (durability == DUR_ASYNC) sync_start(&fullmask); // group commit uses the ring's own fsync
+		of_pinned = true;
+		uring_init();
+		uring_serve();
+	}
+#endif
+
+	// start workers (must be after fork)
+	int nspawn = nthreads;
+#ifndef USE_AESD_CHAR_DEVICE
+	if (mode == MODE_THREAD) ++nspawn; // and an epoll worker its followers are handed to, last
+#endif
+	workers = calloc(nspawn, sizeof(struct worker));
+	if (!workers) cleanup(SRC_MALLOC);
+	if (mode == MODE_THREAD) {
+		workq_cap = WORKQ_PER_THREAD*nthreads;
+		workq = calloc(workq_cap, sizeof(struct client));
+		if (!workq) cleanup(SRC_MALLOC);
+		sem_init(&workq_items, 0, 0);
+		sem_init(&workq_free, 0, workq_cap);
+	}
+	for (int i = 0; i < nspawn; ++i) { // nworkers only counts running workers in case of failure
+		workers[i].epfd = workers[i].wakefd = -1;
+		bool epoll = mode == MODE_EPOLL || i == nthreads;
+		if (epoll) {
+			workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+			if (workers[i].epfd == -1) cleanup(SRC_EPOLL);
+#ifndef USE_AESD_CHAR_DEVICE
+			// woken by the syncer, appenders and a handoff (no connection attached)
+			workers[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+			if (workers[i].wakefd == -1 || epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].wakefd, &ev) == -1) {
+				close(workers[i].epfd);
+				if (workers[i].wakefd != -1) close(workers[i].wakefd);
+				cleanup(SRC_EPOLL);
+			}
+#endif
+		}
+		pthread_sigmask(SIG_BLOCK, &fullmask, NULL); // this thread handles all signals
+		s = pthread_create(&workers[i].tid, NULL, (epoll) ? epoll_worker : pool_worker, &workers[i]);
+		pthread_sigmask(SIG_UNBLOCK, &fullmask, NULL);
+		if (s != 0) {
+			if (workers[i].epfd != -1) close(workers[i].epfd);
+			if (workers[i].wakefd != -1) close(workers[i].wakefd);
+			cleanup_errno(SRC_PTHCR, s);
+		}
+		++nworkers;
+	}
+#ifndef USE_AESD_CHAR_DEVICE
+	if (mode == MODE_THREAD) follow_worker = &workers[nthreads];
+	if (durability != DUR_NONE) sync_start(&fullmask); // pokes the workers, so after them
+#endif
+
+	// a single listener is served from this thread
+	if (nlisteners == 1) {
+		accept_loop(0, cleanup);
+		while (1) pause(); // handing off
+	}
+
+	// otherwise start an acceptor per listener, pinned to its core (or unpinned if that's refused)
+	for (int i = 0; i < nlisteners; ++i) { // nacceptors only counts running acceptors in case of failure
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		if (acceptors[i].cpu != -1) CPU_SET(acceptors[i].cpu, &cpus);
+		s = (acceptors[i].cpu != -1) ? pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus) : 0;
+		pthread_sigmask(SIG_BLOCK, &fullmask, NULL); // this thread handles all signals
+		if (s == 0) s = pthread_create(&acceptors[i].tid, &attr, acceptor, &acceptors[i]);
+		if (s != 0 && acceptors[i].cpu != -1) {
+			syslog(LOG_WARNING, "can't pin acceptor %d to core %d, leaving it unpinned: %s", i, acceptors[i].cpu, strerror(s));
+			acceptors[i].cpu = -1;
+			s = pthread_create(&acceptors[i].tid, NULL, acceptor, &acceptors[i]);
+		}
+		pthread_sigmask(SIG_UNBLOCK, &fullmask, NULL);
+		pthread_attr_destroy(&attr);
+		if (s != 0) cleanup_errno(SRC_PTHCR, s);
+		++nacceptors;
+	}
+
+	// wait for a signal to exit
+	while (1) pause();
 }
-				
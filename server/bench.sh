@@ -0,0 +1,53 @@
+#!/bin/bash
+# Run the aesdbench scenarios against each server build and print one JSON result per line.
+# Servers need port 9000 free; the char device build is skipped unless /dev/aesdchar is writable.
+# Usage: bench.sh [seconds per scenario] [server builds...]
+cd `dirname $0`
+secs=${1:-5}
+shift
+servers=${@:-"aesdsocket aesdsocket-chrdev"}
+
+# scenario: server args | bench args
+scenarios=(
+	"|-c 8"
+	"-k -r record|-k -r record -c 8 -n 100"
+	"-k -r record -u /tmp/aesdbench.sock|-k -r record -c 8 -n 100 -u /tmp/aesdbench.sock"
+	"-k -r none|-k -r none -c 8 -n 1000"
+	"-m epoll -k -r none|-k -r none -c 64 -n 1000"
+)
+
+# wait until the server is accepting
+wait_port() {
+	for i in $(seq 50); do
+		(exec 3<>/dev/tcp/127.0.0.1/9000) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+rc=0
+for server in $servers; do
+	if [ ! -x ./$server ]; then
+		echo "{\"server\":\"$server\",\"skipped\":\"not built\"}"
+		continue
+	fi
+	if [ "$server" = aesdsocket-chrdev ] && [ ! -w /dev/aesdchar ]; then
+		echo "{\"server\":\"$server\",\"skipped\":\"no /dev/aesdchar\"}"
+		continue
+	fi
+	for sc in "${scenarios[@]}"; do
+		sargs=${sc%%|*}
+		bargs=${sc#*|}
+		./$server $sargs 2>/dev/null &
+		pid=$!
+		if wait_port; then
+			./aesdbench -t $secs -l "$server${sargs:+ $sargs}" $bargs || rc=1
+		else
+			echo "{\"server\":\"$server${sargs:+ $sargs}\",\"skipped\":\"server did not start\"}"
+			rc=1
+		fi
+		kill $pid 2>/dev/null
+		wait $pid 2>/dev/null
+	done
+done
+exit $rc